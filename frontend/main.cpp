@@ -30,6 +30,7 @@
 
 /* $Id$ */
 
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
 #include <ios>
@@ -41,6 +42,7 @@
 #include <typeinfo>
 #include <vector>
 #include <simstring/simstring.h>
+#include <simstring/thread_pool.h>
 
 #include "optparse.h"
 
@@ -65,11 +67,15 @@ public:
 
     int ngram_size;
     bool be;
+    int flags;
+    int memory;
     int measure;
     double threshold;
     bool echo_back;
     bool quiet;
     bool benchmark;
+    int num_threads;
+    int open_options;
 
 public:
     option() :
@@ -78,11 +84,15 @@ public:
         name(""),
         ngram_size(3),
         be(false),
+        flags(0),
+        memory(0),
         measure(simstring::cosine),
         threshold(0.7),
         echo_back(false),
         quiet(false),
-        benchmark(false)
+        benchmark(false),
+        num_threads(1),
+        open_options(0)
     {
     }
 };
@@ -107,6 +117,33 @@ class option_parser :
         ON_OPTION(SHORTOPT('m') || LONGOPT("mark"))
             be = true;
 
+        ON_OPTION(SHORTOPT('f') || LONGOPT("fingerprint"))
+            flags |= simstring::FORMAT_FINGERPRINT;
+
+        ON_OPTION(SHORTOPT('c') || LONGOPT("compress"))
+            flags |= simstring::FORMAT_COMPRESSED;
+
+        ON_OPTION(SHORTOPT('k') || LONGOPT("skip-index"))
+            flags |= simstring::FORMAT_SKIP_INDEX;
+
+        ON_OPTION(SHORTOPT('o') || LONGOPT("one-file"))
+            flags |= simstring::FORMAT_SINGLE_FILE;
+
+        ON_OPTION(SHORTOPT('l') || LONGOPT("length"))
+            flags |= simstring::FORMAT_STRING_LENGTH;
+
+        ON_OPTION(SHORTOPT('g') || LONGOPT("huge-align"))
+            flags |= simstring::FORMAT_HUGE_PAGE_ALIGNMENT;
+
+        ON_OPTION(SHORTOPT('x') || LONGOPT("large"))
+            flags |= simstring::FORMAT_LARGE;
+
+        ON_OPTION(SHORTOPT('i') || LONGOPT("dense-id"))
+            flags |= simstring::FORMAT_DENSE_ID;
+
+        ON_OPTION_WITH_ARG(SHORTOPT('M') || LONGOPT("memory"))
+            memory = std::atoi(arg);
+
         ON_OPTION_WITH_ARG(SHORTOPT('s') || LONGOPT("similarity"))
             if (std::strcmp(arg, "exact") == 0) {
                 measure = simstring::exact;
@@ -132,6 +169,21 @@ class option_parser :
         ON_OPTION(SHORTOPT('p') || LONGOPT("benchmark"))
             benchmark = true;
 
+        ON_OPTION_WITH_ARG(SHORTOPT('j') || LONGOPT("threads"))
+            num_threads = std::atoi(arg);
+
+        ON_OPTION(SHORTOPT('w') || LONGOPT("warm-up"))
+            open_options |= simstring::OPEN_POPULATE;
+
+        ON_OPTION(SHORTOPT('r') || LONGOPT("random-access"))
+            open_options |= simstring::OPEN_RANDOM;
+
+        ON_OPTION(SHORTOPT('L') || LONGOPT("lock"))
+            open_options |= simstring::OPEN_LOCK;
+
+        ON_OPTION(SHORTOPT('H') || LONGOPT("huge-pages"))
+            open_options |= simstring::OPEN_HUGE_PAGES;
+
         ON_OPTION(SHORTOPT('v') || LONGOPT("version"))
             mode = MODE_VERSION;
 
@@ -155,6 +207,15 @@ int usage(std::ostream& os, const char *argv0)
     os << "  -u, --unicode         use Unicode (wchar_t) for representing characters" << std::endl;
     os << "  -n, --ngram=N         specify the unit of n-grams (DEFAULT=3)" << std::endl;
     os << "  -m, --mark            include marks for begins and ends of strings" << std::endl;
+    os << "  -f, --fingerprint     store n-grams as 64-bit fingerprints in the database" << std::endl;
+    os << "  -c, --compress        store posting lists in the block-packed encoding" << std::endl;
+    os << "  -k, --skip-index      store skip indices of long posting lists" << std::endl;
+    os << "  -o, --one-file        store the indices in the database file (no .cdb files)" << std::endl;
+    os << "  -l, --length          store the lengths of strings in the database" << std::endl;
+    os << "  -g, --huge-align      align the indices in the database file to huge pages" << std::endl;
+    os << "  -x, --large           support a database file larger than 4 GB" << std::endl;
+    os << "  -i, --dense-id        use sequential numbers of strings as string IDs" << std::endl;
+    os << "  -M, --memory=MB       spill postings to temporary files beyond MB megabytes" << std::endl;
     os << "  -s, --similarity=SIM  specify a similarity measure (DEFAULT='cosine'):" << std::endl;
     os << "      exact                 exact match" << std::endl;
     os << "      dice                  dice coefficient" << std::endl;
@@ -165,6 +226,11 @@ int usage(std::ostream& os, const char *argv0)
     os << "  -e, --echo-back       echo back query strings to the output" << std::endl;
     os << "  -q, --quiet           suppress supplemental information from the output" << std::endl;
     os << "  -p, --benchmark       show benchmark result (retrieved strings are suppressed)" << std::endl;
+    os << "  -j, --threads=N       use N threads for building or queries (DEFAULT=1)" << std::endl;
+    os << "  -w, --warm-up         read the database into memory before retrieval" << std::endl;
+    os << "  -r, --random-access   disable readahead of the database" << std::endl;
+    os << "  -L, --lock            lock the database in memory" << std::endl;
+    os << "  -H, --huge-pages      load the database into huge pages (Linux only)" << std::endl;
     os << "  -v, --version         show this version information and exit" << std::endl;
     os << "  -h, --help            show this help message and exit" << std::endl;
     os << std::endl;
@@ -198,39 +264,64 @@ int build(option& opt, istream_type& is)
     os << "Database name: " << opt.name << std::endl;
     os << "N-gram length: " << opt.ngram_size << std::endl;
     os << "Begin/end marks: " << std::boolalpha << opt.be << std::endl;
+    os << "Fingerprints: " << std::boolalpha << ((opt.flags & simstring::FORMAT_FINGERPRINT) != 0) << std::endl;
+    os << "Compressed postings: " << std::boolalpha << ((opt.flags & simstring::FORMAT_COMPRESSED) != 0) << std::endl;
+    os << "Skip indices: " << std::boolalpha << ((opt.flags & simstring::FORMAT_SKIP_INDEX) != 0) << std::endl;
+    os << "Single file: " << std::boolalpha << ((opt.flags & simstring::FORMAT_SINGLE_FILE) != 0) << std::endl;
+    os << "String lengths: " << std::boolalpha << ((opt.flags & simstring::FORMAT_STRING_LENGTH) != 0) << std::endl;
+    os << "Huge page alignment: " << std::boolalpha << ((opt.flags & simstring::FORMAT_HUGE_PAGE_ALIGNMENT) != 0) << std::endl;
+    os << "Large database: " << std::boolalpha << ((opt.flags & simstring::FORMAT_LARGE) != 0) << std::endl;
+    os << "Dense string IDs: " << std::boolalpha << ((opt.flags & simstring::FORMAT_DENSE_ID) != 0) << std::endl;
+    os << "Memory budget (MB): " << opt.memory << std::endl;
+    os << "Threads: " << opt.num_threads << std::endl;
     os << "Char type: " << typeid(char_type).name() << " (" << sizeof(char_type) << ")" << std::endl;
     os.flush();
 
     // Open the database for construction.
     clock_t clk = std::clock();
     ngram_generator_type gen(opt.ngram_size, opt.be);
-    writer_type db(gen, opt.name);
+    simstring::thread_pool pool(opt.num_threads);
+    writer_type db(gen, opt.name, opt.flags);
     if (db.fail()) {
         es << "ERROR: " << db.error() << std::endl;
         return 1;
     }
+    if (0 < opt.memory) {
+        db.set_memory_budget((size_t)opt.memory << 20, opt.name + ".tmp");
+    }
+    db.set_thread_pool(&pool);
 
-    // Insert every string from STDIN into the database.
+    // Insert every string from STDIN into the database in batches, whose
+    // n-grams are generated by the threads.
     int n = 0;
+    std::vector<string_type> batch;
     for (;;) {
         // Read a line.
         string_type line;
         std::getline(is, line);
-        if (is.eof()) {
+        if (!is.eof()) {
+            batch.push_back(line);
+            if (batch.size() < 10000) {
+                continue;
+            }
+        } else if (batch.empty()) {
             break;
         }
 
-        // Insert the string.
-        if (!db.insert(line)) {
+        // Insert the strings.
+        if (!db.insert(batch)) {
             es << "ERROR: " << db.error() << std::endl;
             return 1;
         }
 
         // Progress report.
-        if (!opt.quiet && ++n % 10000 == 0) {
-            os << "Number of strings: " << n << std::endl;
-            os.flush();
+        for (size_t i = 0;i < batch.size();++i) {
+            if (!opt.quiet && ++n % 10000 == 0) {
+                os << "Number of strings: " << n << std::endl;
+                os.flush();
+            }
         }
+        batch.clear();
     }
     os << "Number of strings: " << n << std::endl;
     os << std::endl;
@@ -266,6 +357,74 @@ std::basic_string<char_type> widen(const std::string& str)
     return dst;
 }
 
+template <class char_type, class ostream_type>
+void output(
+    option& opt,
+    ostream_type& os,
+    const std::basic_string<char_type>& line,
+    const std::vector<std::basic_string<char_type> >& xstrs,
+    double sec
+    )
+{
+    // Do not output results when the benchmarking flag is on.
+    if (!opt.benchmark) {
+        // Output the query string if necessary.
+        if (opt.echo_back) {
+            os << line << std::endl;
+        }
+
+        // Output the retrieved strings.
+        typename std::vector<std::basic_string<char_type> >::const_iterator it;
+        for (it = xstrs.begin();it != xstrs.end();++it) {
+            os << os.widen('\t') << *it << std::endl;
+        }
+        os.flush();
+    }
+
+    // Do not output information when the quiet flag is on.
+    if (!opt.quiet) {
+        os <<
+            xstrs.size() <<
+            widen<char_type>(" strings retrieved (") <<
+            sec <<
+            widen<char_type>(" sec)") << std::endl;
+    }
+}
+
+// A job that issues a chunk of queries on the thread pool.
+template <class char_type>
+class retrieve_job : public simstring::thread_pool::job
+{
+public:
+    typedef std::basic_string<char_type> string_type;
+    typedef std::vector<string_type> strings_type;
+    typedef simstring::reader reader_type;
+    typedef reader_type::context<string_type> context_type;
+
+    const option& opt;
+    const reader_type& db;
+    std::vector<context_type> contexts;
+    std::vector<string_type> queries;
+    std::vector<strings_type> results;
+    std::vector<double> seconds;
+
+    retrieve_job(const option& opt_, const reader_type& db_, int num_workers)
+        : opt(opt_), db(db_), contexts(num_workers)
+    {
+    }
+
+    void run(int index, int worker)
+    {
+        std::chrono::steady_clock::time_point clk = std::chrono::steady_clock::now();
+        results[index].clear();
+        db.retrieve(
+            contexts[worker], queries[index], opt.measure, opt.threshold,
+            std::back_inserter(results[index]));
+        seconds[index] = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - clk).count();
+    }
+};
+
 template <class char_type, class istream_type, class ostream_type>
 int retrieve(option& opt, istream_type& is, ostream_type& os)
 {
@@ -277,10 +436,15 @@ int retrieve(option& opt, istream_type& is, ostream_type& os)
 
     // Open the database.
     reader_type db;
-    if (!db.open(opt.name)) {
+    if (!db.open(opt.name, opt.open_options)) {
         es << "ERROR: " << db.error() << std::endl;
         return 1;
     }
+    if (opt.open_options != 0 && !opt.quiet) {
+        os <<
+            widen<char_type>("Seconds for warming up: ") <<
+            db.warmup_time() << std::endl;
+    }
 
     // Check the size of characters.
     if (db.char_size() != sizeof(char_type)) {
@@ -293,48 +457,65 @@ int retrieve(option& opt, istream_type& is, ostream_type& os)
 
     int num_queries = 0;
     int num_retrieved = 0;
-    clock_t clk_total = 0;
-    for (;;) {
-        // Read a line.
-        string_type line;
-        std::getline(is, line);
-        if (is.eof()) {
-            break;
-        }
-
-        // Issue a query.
-        strings_type xstrs;
-        clock_t clk = std::clock();
-        db.retrieve(line, opt.measure, opt.threshold, std::back_inserter(xstrs));
-        clock_t elapsed = (std::clock() - clk);
-
-        // Update stats.
-        clk_total += elapsed;
-        num_retrieved += (int)xstrs.size();
-        ++num_queries;
-
-        // Do not output results when the benchmarking flag is on.
-        if (!opt.benchmark) {
-            // Output the query string if necessary.
-            if (opt.echo_back) {
-                os << line << std::endl;
+    double sec_total = 0.;
+
+    if (1 < opt.num_threads) {
+        // Read queries in chunks, issue them on the worker threads, and
+        // output the results in the order of the queries.
+        const int chunk_size = 1024 * opt.num_threads;
+        simstring::thread_pool pool(opt.num_threads);
+        retrieve_job<char_type> job(opt, db, pool.size());
+
+        while (!is.eof()) {
+            // Read a chunk of lines.
+            job.queries.clear();
+            while ((int)job.queries.size() < chunk_size) {
+                string_type line;
+                std::getline(is, line);
+                if (is.eof()) {
+                    break;
+                }
+                job.queries.push_back(line);
             }
 
-            // Output the retrieved strings.
-            typename strings_type::const_iterator it;
-            for (it = xstrs.begin();it != xstrs.end();++it) {
-                os << os.widen('\t') << *it << std::endl;
+            // Issue the queries.
+            const int n = (int)job.queries.size();
+            job.results.resize(n);
+            job.seconds.resize(n);
+            pool.run(job, n);
+
+            // Output the results.
+            for (int i = 0;i < n;++i) {
+                sec_total += job.seconds[i];
+                num_retrieved += (int)job.results[i].size();
+                ++num_queries;
+                output(opt, os, job.queries[i], job.results[i], job.seconds[i]);
             }
-            os.flush();
         }
 
-        // Do not output information when the quiet flag is on.
-        if (!opt.quiet) {
-            os <<
-                xstrs.size() <<
-                widen<char_type>(" strings retrieved (") <<
-                (std::clock() - clk) / (double)CLOCKS_PER_SEC <<
-                widen<char_type>(" sec)") << std::endl;
+    } else {
+        reader_type::context<string_type> ctx;
+        for (;;) {
+            // Read a line.
+            string_type line;
+            std::getline(is, line);
+            if (is.eof()) {
+                break;
+            }
+
+            // Issue a query.
+            strings_type xstrs;
+            std::chrono::steady_clock::time_point clk = std::chrono::steady_clock::now();
+            db.retrieve(ctx, line, opt.measure, opt.threshold, std::back_inserter(xstrs));
+            double sec = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - clk).count();
+
+            // Update stats.
+            sec_total += sec;
+            num_retrieved += (int)xstrs.size();
+            ++num_queries;
+
+            output(opt, os, line, xstrs, sec);
         }
     }
 
@@ -345,7 +526,7 @@ int retrieve(option& opt, istream_type& is, ostream_type& os)
             num_queries << std::endl;
         os <<
             widen<char_type>("Seconds per query: ") <<
-            clk_total / (double)CLOCKS_PER_SEC / num_queries << std::endl;
+            sec_total / num_queries << std::endl;
         os <<
             widen<char_type>("Number of retrieved strings per query: ") <<
             num_retrieved / (double)num_queries << std::endl;
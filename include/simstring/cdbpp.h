@@ -198,8 +198,9 @@ protected:
 
 protected:
     std::ofstream&  m_os;               // Output stream.
-    uint32_t        m_begin;
-    uint32_t        m_cur;
+    std::streamoff  m_begin;            // Offset of the chunk in the stream.
+    uint32_t        m_cur;              // Offset from the chunk.
+    uint32_t        m_num;              // Number of records.
     hashtable       m_ht[NUM_TABLES];   // Hash tables.
 
 public:
@@ -211,8 +212,9 @@ public:
      */
     builder_base(std::ofstream& os) : m_os(os)
     {
-        m_begin = (uint32_t)m_os.tellp();
+        m_begin = m_os.tellp();
         m_cur = get_data_begin();
+        m_num = 0;
         m_os.seekp(m_begin + m_cur);
     }
 
@@ -236,6 +238,13 @@ public:
     template <class key_t, class value_t>
     void put(const key_t *key, size_t ksize, const value_t *value, size_t vsize)
     {
+        // Offsets in a chunk are 32-bit; make sure that the chunk with the
+        // record and hash tables (two buckets per record) fits into 4 GB.
+        uint64_t size = (uint64_t)m_cur + sizeof(uint32_t) + ksize + sizeof(uint32_t) + vsize;
+        if (0xFFFFFFFFULL < size + sizeof(bucket) * 2 * ((uint64_t)m_num + 1)) {
+            throw builder_exception("The chunk exceeds 4 GB");
+        }
+
         // Write out the current record.
         write_uint32((uint32_t)ksize);
         m_os.write(reinterpret_cast<const char *>(key), ksize);
@@ -250,14 +259,15 @@ public:
         ht.push_back(bucket(hv, m_cur));
 
         // Increment the current position.
-        m_cur += sizeof(uint32_t) + ksize + sizeof(uint32_t) + vsize;
+        m_cur = (uint32_t)size;
+        ++m_num;
     }
 
 protected:
     void close()
     {
         // Check the consistency of the stream offset.
-        if (m_begin + m_cur != (uint32_t)m_os.tellp()) {
+        if (m_begin + m_cur != m_os.tellp()) {
             throw builder_exception("Inconsistent stream offset");
         }
 
@@ -302,7 +312,7 @@ protected:
         }
 
         // Store the current position.
-        uint32_t offset = (uint32_t)m_os.tellp();
+        std::streamoff offset = m_os.tellp();
 
         // Rewind the stream position to the beginning.
         m_os.seekp(m_begin);
@@ -310,7 +320,7 @@ protected:
         // Write the file header.
         char chunkid[4] = {'C','D','B','+'};
         m_os.write(chunkid, 4);
-        write_uint32(offset - m_begin);
+        write_uint32((uint32_t)(offset - m_begin));
         write_uint32(CDBPP_VERSION);
         write_uint32(BYTEORDER_CHECK);
 
@@ -590,7 +600,23 @@ public:
      */
     const void* get(const void *key, size_t ksize, size_t* vsize) const
     {
-        uint32_t hv = hash_function()(key, ksize);
+        return this->get(key, ksize, hash(key, ksize), vsize);
+    }
+
+    /**
+     * Finds the key in the database with its hash value.
+     *  Databases using the same hash function can share the hash value of
+     *  a key, which saves the computation when the key is looked up in
+     *  several databases.
+     *  @param  key         The pointer to the key.
+     *  @param  ksize       The size of the key.
+     *  @param  hv          The hash value of the key obtained by hash().
+     *  @param  vsize       The pointer of a variable to which the size of the
+     *                      value returned. This parameter can be \c NULL.
+     *  @return const void* The pointer to the value.
+     */
+    const void* get(const void *key, size_t ksize, uint32_t hv, size_t* vsize) const
+    {
         const hashtable_t* ht = &m_ht[hv % NUM_TABLES];
 
         if (ht->num && ht->buckets != NULL) {
@@ -620,6 +646,17 @@ public:
         return NULL;
     }
 
+    /**
+     * Computes the hash value of a key.
+     *  @param  key         The pointer to the key.
+     *  @param  ksize       The size of the key.
+     *  @return uint32_t    The hash value.
+     */
+    static uint32_t hash(const void *key, size_t ksize)
+    {
+        return hash_function()(key, ksize);
+    }
+
 protected:
     inline uint32_t read_uint32(const uint8_t* p) const
     {
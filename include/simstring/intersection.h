@@ -0,0 +1,234 @@
+/*
+ *      Search routines for sorted posting lists.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_INTERSECTION_H__
+#define __SIMSTRING_INTERSECTION_H__
+
+#include <stdint.h>
+#include <algorithm>
+
+// The block-compare routines require SSE2 as the baseline of the target;
+// otherwise, the scalar versions are used.
+#if     defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SIMSTRING_USE_X86_SIMD  1
+#include <immintrin.h>
+#endif
+
+namespace simstring
+{
+
+/**
+ * Finds the first element that is not less than a value by galloping.
+ *  The cost is logarithmic to the distance from \c first to the result,
+ *  which suits a sparse sequence of probes on a long list.
+ *  @param  first       The pointer to the first element of a sorted array.
+ *  @param  last        The pointer next to the last element.
+ *  @param  value       The value to be searched for.
+ *  @return             The pointer to the first element not less than
+ *                      \c value, or \c last if no such element exists.
+ */
+template <class value_type>
+inline const value_type* gallop(
+    const value_type* first,
+    const value_type* last,
+    value_type value
+    )
+{
+    if (first == last || !(*first < value)) {
+        return first;
+    }
+
+    // Find the range [first + bound / 2, first + bound] containing the value.
+    size_t bound = 1;
+    const size_t n = (size_t)(last - first);
+    while (bound < n && first[bound] < value) {
+        bound *= 2;
+    }
+
+    return std::lower_bound(
+        first + bound / 2 + 1,
+        first + std::min(bound + 1, n),
+        value
+        );
+}
+
+/**
+ * Finds the first element that is not less than a value by a linear scan.
+ *  This is faster than galloping when the probes are dense.
+ *  @param  first       The pointer to the first element of a sorted array.
+ *  @param  last        The pointer next to the last element.
+ *  @param  value       The value to be searched for.
+ *  @return             The pointer to the first element not less than
+ *                      \c value, or \c last if no such element exists.
+ */
+template <class value_type>
+inline const value_type* scan(
+    const value_type* first,
+    const value_type* last,
+    value_type value
+    )
+{
+    while (first != last && *first < value) {
+        ++first;
+    }
+    return first;
+}
+
+#ifdef  SIMSTRING_USE_X86_SIMD
+
+/*
+ * Block-compare versions of scan() for 32-bit unsigned integers. The sign
+ * bits are flipped so that the signed comparison of SSE2/AVX2 orders the
+ * values as unsigned integers. Elements less than the value form a prefix
+ * of a block because the array is sorted.
+ */
+
+inline const uint32_t* scan_sse2(
+    const uint32_t* first,
+    const uint32_t* last,
+    uint32_t value
+    )
+{
+    const __m128i bias = _mm_set1_epi32((int)0x80000000);
+    const __m128i v = _mm_xor_si128(_mm_set1_epi32((int)value), bias);
+    while (4 <= last - first) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        __m128i lt = _mm_cmpgt_epi32(v, _mm_xor_si128(x, bias));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(lt));
+        if (mask != 0x0F) {
+            return first + __builtin_ctz(~mask);
+        }
+        first += 4;
+    }
+    while (first != last && *first < value) {
+        ++first;
+    }
+    return first;
+}
+
+__attribute__((target("avx2")))
+inline const uint32_t* scan_avx2(
+    const uint32_t* first,
+    const uint32_t* last,
+    uint32_t value
+    )
+{
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+    const __m256i v = _mm256_xor_si256(_mm256_set1_epi32((int)value), bias);
+    while (8 <= last - first) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        __m256i lt = _mm256_cmpgt_epi32(v, _mm256_xor_si256(x, bias));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+        if (mask != 0xFF) {
+            return first + __builtin_ctz(~mask);
+        }
+        first += 8;
+    }
+    return scan_sse2(first, last, value);
+}
+
+typedef const uint32_t* (*scan_uint32_function)(const uint32_t*, const uint32_t*, uint32_t);
+
+/**
+ * Chooses the block-compare routine supported by the CPU.
+ */
+inline scan_uint32_function choose_scan_uint32()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+    return scan_sse2;
+}
+
+template <>
+inline const uint32_t* scan<uint32_t>(
+    const uint32_t* first,
+    const uint32_t* last,
+    uint32_t value
+    )
+{
+    static const scan_uint32_function func = choose_scan_uint32();
+    return func(first, last, value);
+}
+
+#endif/*SIMSTRING_USE_X86_SIMD*/
+
+/**
+ * A cursor that tests the membership of ascending values in a sorted array.
+ *  The cursor chooses a linear (block-compare) scan when the number of
+ *  probes is large relative to the length of the array, and galloping
+ *  otherwise. Values must be probed in the ascending order.
+ */
+template <class value_type>
+class sorted_cursor
+{
+protected:
+    const value_type*   m_cur;
+    const value_type*   m_last;
+    bool                m_dense;
+
+public:
+    /**
+     * The average distance between probes below which a linear scan is
+     * preferred to galloping.
+     */
+    enum { dense_gap = 64 };
+
+    /**
+     * Constructs a cursor.
+     *  @param  first       The pointer to the first element of a sorted array.
+     *  @param  last        The pointer next to the last element.
+     *  @param  num_probes  The expected number of probes.
+     */
+    sorted_cursor(const value_type* first, const value_type* last, size_t num_probes)
+        : m_cur(first), m_last(last),
+        m_dense((size_t)(last - first) < num_probes * dense_gap)
+    {
+    }
+
+    /**
+     * Tests whether the array contains a value.
+     *  @param  value       The value, which must not be smaller than the
+     *                      value of the previous call.
+     *  @return bool        \c true if the array contains the value.
+     */
+    bool contains(value_type value)
+    {
+        m_cur = m_dense ? scan(m_cur, m_last, value) : gallop(m_cur, m_last, value);
+        return (m_cur != m_last && *m_cur == value);
+    }
+};
+
+};
+
+#endif/*__SIMSTRING_INTERSECTION_H__*/
@@ -38,6 +38,15 @@
 
 namespace simstring { namespace measure {
 
+/*
+ * The traits of a similarity measure provide:
+ *  - min_size(): the minimum number of n-grams of strings to be retrieved,
+ *  - max_size(): the maximum number of n-grams of strings to be retrieved,
+ *  - min_match(): the minimum overlap count required for a string,
+ *  - score(): the similarity computed from the numbers of n-grams of the
+ *    query and a string, and their overlap count.
+ */
+
 /**
  * This class implements the traits of exact matching.
  */
@@ -57,6 +66,11 @@ struct exact
     {
         return qsize;
     }
+
+    inline static double score(int qsize, int rsize, int num)
+    {
+        return (qsize == rsize && num == qsize) ? 1. : 0.;
+    }
 };
 
 /**
@@ -78,6 +92,11 @@ struct dice
     {
         return (int)std::ceil(0.5 * alpha * (qsize + rsize));
     }
+
+    inline static double score(int qsize, int rsize, int num)
+    {
+        return 2. * num / (qsize + rsize);
+    }
 };
 
 /**
@@ -99,6 +118,11 @@ struct cosine
     {
         return (int)std::ceil(alpha * std::sqrt((double)qsize * rsize));
     }
+
+    inline static double score(int qsize, int rsize, int num)
+    {
+        return num / std::sqrt((double)qsize * rsize);
+    }
 };
 
 /**
@@ -120,6 +144,11 @@ struct jaccard
     {
         return (int)std::ceil(alpha * (qsize + rsize) / (1 + alpha));
     }
+
+    inline static double score(int qsize, int rsize, int num)
+    {
+        return (double)num / (qsize + rsize - num);
+    }
 };
 
 /**
@@ -141,6 +170,11 @@ struct overlap
     {
         return (int)std::ceil(alpha * std::min(qsize, rsize));
     }
+
+    inline static double score(int qsize, int rsize, int num)
+    {
+        return (double)num / std::min(qsize, rsize);
+    }
 };
 
 }; };
@@ -41,6 +41,15 @@ class memory_mapped_file_base
 public:
     typedef size_t size_type;
 
+    /**
+     * Patterns of accesses to a mapped region.
+     */
+    enum {
+        access_normal = 0,
+        access_random,
+        access_sequential,
+    };
+
     memory_mapped_file_base() {}
     virtual ~memory_mapped_file_base() {}
 
@@ -52,6 +61,25 @@ public:
     char* data() const {return NULL; }
     const char* const_data() const {return NULL; }
     static int alignment() {return 0; }
+
+    /*
+     * The following functions apply to the region [offset, offset+length)
+     * of the mapping, where a length of zero stands for the rest of the
+     * mapping. advise() tells the access pattern of the region to the OS,
+     * populate() reads the region into memory before returning, and lock()
+     * keeps the region in memory until the mapping is closed.
+     */
+    bool advise(int access, size_type offset = 0, size_type length = 0) {return false; }
+    bool populate(size_type offset = 0, size_type length = 0) {return false; }
+    bool lock(size_type offset = 0, size_type length = 0) {return false; }
+
+    /*
+     * load_huge_pages() copies the file into anonymous memory backed by huge
+     * pages, which replaces the mapping (and changes the data pointer) of a
+     * file opened for reading. The memory is private to the process.
+     */
+    bool load_huge_pages() {return false; }
+    static size_type huge_page_size() {return 0; }
 };
 
 #if     defined(_WIN32)
@@ -54,6 +54,7 @@ protected:
     std::ios_base::openmode m_mode;
     void*                   m_data;
     size_type               m_size;
+    size_type               m_length;
 
 public:
     memory_mapped_file_posix()
@@ -62,6 +63,7 @@ public:
         m_mode = std::ios_base::in;
         m_data = NULL;
         m_size = 0;
+        m_length = 0;
     }
 
     virtual ~memory_mapped_file_posix()
@@ -146,18 +148,24 @@ public:
             MAP_SHARED,
             m_fd,
             0);
+        if (m_data == MAP_FAILED) {
+            m_data = NULL;
+            return false;
+        }
 
         m_size = size;
+        m_length = size;
         return true;
     }
 
     void free()
     {
         if (m_data != NULL) {
-            ::munmap(m_data, m_size);   
+            ::munmap(m_data, m_length);
             m_data = NULL;
         }
         m_size = 0;
+        m_length = 0;
     }
 
     size_type size() const
@@ -179,6 +187,128 @@ public:
     {
         return 0;
     }
+
+    bool advise(int access, size_type offset = 0, size_type length = 0)
+    {
+        char* addr = NULL;
+        if (!this->region(offset, length, addr)) {
+            return false;
+        }
+
+        int advice = MADV_NORMAL;
+        if (access == access_random) {
+            advice = MADV_RANDOM;
+        } else if (access == access_sequential) {
+            advice = MADV_SEQUENTIAL;
+        }
+        return (::madvise(addr, length, advice) == 0);
+    }
+
+    bool populate(size_type offset = 0, size_type length = 0)
+    {
+        char* addr = NULL;
+        if (!this->region(offset, length, addr)) {
+            return false;
+        }
+
+        /* Start reading the region, and touch every page of it so that the
+           region is resident when this function returns. */
+        ::madvise(addr, length, MADV_WILLNEED);
+        const size_type page = (size_type)::sysconf(_SC_PAGESIZE);
+        volatile char c = 0;
+        for (size_type i = 0;i < length;i += page) {
+            c ^= addr[i];
+        }
+        return true;
+    }
+
+    bool lock(size_type offset = 0, size_type length = 0)
+    {
+        char* addr = NULL;
+        if (!this->region(offset, length, addr)) {
+            return false;
+        }
+        return (::mlock(addr, length) == 0);
+    }
+
+    bool load_huge_pages()
+    {
+#if     defined(MAP_ANONYMOUS) && (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+        if (m_data == NULL || (m_mode & std::ios_base::out)) {
+            return false;
+        }
+
+        const size_type huge = huge_page_size();
+        const size_type length = (m_size + huge - 1) / huge * huge;
+        void* p = MAP_FAILED;
+
+#ifdef  MAP_HUGETLB
+        /* Try to allocate pages from the pool of huge pages. */
+        p = ::mmap(
+            NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif/*MAP_HUGETLB*/
+
+#ifdef  MADV_HUGEPAGE
+        if (p == MAP_FAILED) {
+            /* Fall back to transparent huge pages, which requires the region
+               to be aligned to the huge page boundary. */
+            char* q = reinterpret_cast<char*>(::mmap(
+                NULL, length + huge, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (q != MAP_FAILED) {
+                size_type head = (huge - (size_type)q % huge) % huge;
+                if (head != 0) {
+                    ::munmap(q, head);
+                }
+                ::munmap(q + head + length, huge - head);
+                p = q + head;
+                if (::madvise(p, length, MADV_HUGEPAGE) != 0) {
+                    ::munmap(p, length);
+                    p = MAP_FAILED;
+                }
+            }
+        }
+#endif/*MADV_HUGEPAGE*/
+
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        /* Copy the content of the file, and replace the file mapping. */
+        memcpy(p, m_data, m_size);
+        ::mprotect(p, length, PROT_READ);
+        ::munmap(m_data, m_length);
+        m_data = p;
+        m_length = length;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static size_type huge_page_size()
+    {
+        return 2 * 1024 * 1024;
+    }
+
+protected:
+    bool region(size_type offset, size_type& length, char*& addr) const
+    {
+        if (m_data == NULL || m_size < offset) {
+            return false;
+        }
+        if (length == 0 || m_size - offset < length) {
+            length = m_size - offset;
+        }
+
+        /* Extend the region to the page boundary. */
+        const size_type page = (size_type)::sysconf(_SC_PAGESIZE);
+        const size_type begin = offset - offset % page;
+        addr = reinterpret_cast<char*>(m_data) + begin;
+        length += offset - begin;
+        return true;
+    }
 };
 
 #endif/*__MEMORY_MAPPED_FILE_POSIX_H__*/
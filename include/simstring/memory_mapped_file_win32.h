@@ -89,7 +89,7 @@ public:
 		m_hFile = CreateFileA(
 			path.c_str(),
 			dwDesiredAccess,
-			0,
+			(mode & std::ios_base::out) ? 0 : FILE_SHARE_READ,
 			NULL,
 			dwCreationDisposition,
 			FILE_ATTRIBUTE_NORMAL,
@@ -197,6 +197,74 @@ public:
     {
         return 0;
     }
+
+    bool advise(int access, size_type offset = 0, size_type length = 0)
+    {
+        // Windows has no hint of the access pattern for a mapped view.
+        char* addr = NULL;
+        return this->region(offset, length, addr);
+    }
+
+    bool populate(size_type offset = 0, size_type length = 0)
+    {
+        char* addr = NULL;
+        if (!this->region(offset, length, addr)) {
+            return false;
+        }
+
+        // Touch every page of the region.
+        const size_type page = page_size();
+        volatile char c = 0;
+        for (size_type i = 0;i < length;i += page) {
+            c ^= addr[i];
+        }
+        return true;
+    }
+
+    bool lock(size_type offset = 0, size_type length = 0)
+    {
+        char* addr = NULL;
+        if (!this->region(offset, length, addr)) {
+            return false;
+        }
+        return (VirtualLock(addr, length) != 0);
+    }
+
+    bool load_huge_pages()
+    {
+        // Large pages of Windows require SeLockMemoryPrivilege; not supported.
+        return false;
+    }
+
+    static size_type huge_page_size()
+    {
+        return 2 * 1024 * 1024;
+    }
+
+protected:
+    static size_type page_size()
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        return (size_type)si.dwPageSize;
+    }
+
+    bool region(size_type offset, size_type& length, char*& addr) const
+    {
+        if (m_data == NULL || m_size < offset) {
+            return false;
+        }
+        if (length == 0 || m_size - offset < length) {
+            length = m_size - offset;
+        }
+
+        // Extend the region to the page boundary.
+        const size_type page = page_size();
+        const size_type begin = offset - offset % page;
+        addr = m_data + begin;
+        length += offset - begin;
+        return true;
+    }
 };
 
 #endif/*__MEMORY_MAPPED_FILE_WIN32_H__*/
\ No newline at end of file
@@ -33,13 +33,342 @@
 #ifndef __NGRAM_H__
 #define __NGRAM_H__
 
-#include <map>
-#include <sstream>
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
 #include <string>
+#include <vector>
 
 namespace simstring
 {
 
+/**
+ * Converts a letter into an unsigned code.
+ *  Codes ascend in the order that std::char_traits compares letters; the
+ *  sign bit of a signed letter type is flipped for this purpose.
+ *  @param  c       The letter.
+ *  @return uint64_t    The code of the letter.
+ */
+template <class char_type>
+inline uint64_t ngram_letter_code(char_type c)
+{
+    const uint64_t mask = ((uint64_t)1 << (8 * sizeof(char_type))) - 1;
+    uint64_t v = (uint64_t)c & mask;
+    if (std::numeric_limits<char_type>::is_signed) {
+        v ^= (mask >> 1) + 1;
+    }
+    return v;
+}
+
+template <>
+inline uint64_t ngram_letter_code<char>(char c)
+{
+    // std::char_traits<char> compares letters as unsigned char.
+    return (unsigned char)c;
+}
+
+/**
+ * Converts an unsigned code into a letter.
+ *  @param  v       The code of the letter.
+ *  @return char_type   The letter.
+ */
+template <class char_type>
+inline char_type ngram_letter(uint64_t v)
+{
+    if (std::numeric_limits<char_type>::is_signed) {
+        const uint64_t mask = ((uint64_t)1 << (8 * sizeof(char_type))) - 1;
+        v ^= (mask >> 1) + 1;
+    }
+    return (char_type)v;
+}
+
+template <>
+inline char ngram_letter<char>(uint64_t v)
+{
+    return (char)(unsigned char)v;
+}
+
+/**
+ * Packs the n-grams of a string into 64-bit integers (the unit of n-grams
+ *  is a template argument).
+ */
+template <int N, class char_type>
+inline void pack_ngrams(const char_type* src, size_t length, std::vector<uint64_t>& codes)
+{
+    const int bits = 8 * sizeof(char_type);
+    for (size_t i = 0;i + N <= length;++i) {
+        uint64_t v = 0;
+        for (int k = 0;k < N;++k) {
+            v = (v << bits) | ngram_letter_code(src[i+k]);
+        }
+        codes.push_back(v);
+    }
+}
+
+/**
+ * Packs the n-grams of a string into 64-bit integers, and sorts them.
+ *  The letters of an n-gram are stored from the most significant bits, so
+ *  that the order of the integers agrees with the lexicographical order of
+ *  the n-grams.
+ *  @param  src     The pointer to the string.
+ *  @param  length  The length of the string.
+ *  @param  n       The unit of n-grams.
+ *  @param  codes   The array that receives the sorted integers.
+ *  @return bool    \c false if an n-gram does not fit into 64 bits.
+ */
+template <class char_type>
+inline bool pack_ngrams(const char_type* src, size_t length, int n, std::vector<uint64_t>& codes)
+{
+    if (n < 1 || 4 < sizeof(char_type) || 8 < sizeof(char_type) * n) {
+        return false;
+    }
+
+    codes.clear();
+    switch (n) {
+    case 2:
+        pack_ngrams<2>(src, length, codes);
+        break;
+    case 3:
+        pack_ngrams<3>(src, length, codes);
+        break;
+    case 4:
+        pack_ngrams<4>(src, length, codes);
+        break;
+    default:
+        {
+            const int bits = 8 * sizeof(char_type);
+            for (size_t i = 0;i + n <= length;++i) {
+                uint64_t v = 0;
+                for (int k = 0;k < n;++k) {
+                    v = (v << bits) | ngram_letter_code(src[i+k]);
+                }
+                codes.push_back(v);
+            }
+        }
+        break;
+    }
+
+    std::sort(codes.begin(), codes.end());
+    return true;
+}
+
+/**
+ * A reusable array of n-grams.
+ *
+ *  This class generates the n-grams of a string and stores them. An object
+ *  keeps the memory of the n-gram strings and of its scratch buffers when
+ *  it receives n-grams of another string, so that generating n-grams for
+ *  strings of similar lengths repeatedly does not allocate memory.
+ *
+ *  N-grams are sorted and counted as 64-bit integers when n letters fit
+ *  into 64 bits, and as positions in the string otherwise. The n-grams
+ *  are emitted in the lexicographical order, and the k-th occurrence
+ *  (k >= 2) of an n-gram is distinguished by appending the decimal number
+ *  k to it.
+ *
+ *  @param  string_tmpl     The type of a string.
+ */
+template <class string_tmpl>
+class ngram_buffer
+{
+public:
+    /// The type of a string.
+    typedef string_tmpl string_type;
+    /// The type of an n-gram.
+    typedef string_tmpl value_type;
+    /// The type of an array of n-grams.
+    typedef std::vector<string_type> ngrams_type;
+    /// The type of a size.
+    typedef typename ngrams_type::size_type size_type;
+    /// The type of a read-only iterator of n-grams.
+    typedef typename ngrams_type::const_iterator const_iterator;
+
+protected:
+    typedef typename string_type::value_type char_type;
+    typedef typename string_type::traits_type traits_type;
+
+    /// The n-grams; elements at m_size and later are kept for reuse.
+    ngrams_type m_ngrams;
+    /// The number of n-grams.
+    size_type m_size;
+    /// The string padded with begin/end marks.
+    string_type m_src;
+    /// The n-grams packed into integers.
+    std::vector<uint64_t> m_codes;
+    /// The positions of n-grams in m_src.
+    std::vector<size_type> m_pos;
+
+    // Orders positions by the n-grams starting at them.
+    struct less_ngram
+    {
+        const char_type* src;
+        size_type n;
+
+        less_ngram(const char_type* src_, size_type n_) : src(src_), n(n_)
+        {
+        }
+
+        bool operator()(size_type x, size_type y) const
+        {
+            return (traits_type::compare(src + x, src + y, n) < 0);
+        }
+    };
+
+public:
+    /**
+     * Constructs an empty array.
+     */
+    ngram_buffer() : m_size(0)
+    {
+    }
+
+    /**
+     * Returns the number of n-grams.
+     *  @return size_type   The number of n-grams.
+     */
+    size_type size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * Tests whether the array is empty.
+     *  @return bool        \c true if the array has no n-gram.
+     */
+    bool empty() const
+    {
+        return (m_size == 0);
+    }
+
+    /**
+     * Returns an iterator to the first n-gram.
+     */
+    const_iterator begin() const
+    {
+        return m_ngrams.begin();
+    }
+
+    /**
+     * Returns an iterator next to the last n-gram.
+     */
+    const_iterator end() const
+    {
+        return m_ngrams.begin() + m_size;
+    }
+
+    /**
+     * Returns an n-gram.
+     *  @param  i           The index of the n-gram.
+     *  @return const string_type&  The n-gram.
+     */
+    const string_type& operator[](size_type i) const
+    {
+        return m_ngrams[i];
+    }
+
+    /**
+     * Removes all n-grams, retaining the memory.
+     */
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    /**
+     * Generates the n-grams of a string, replacing the current n-grams.
+     *  @param  str     The string.
+     *  @param  n       The unit of n-grams.
+     *  @param  be      \c true to generate n-grams that encode begin and end
+     *                  of a string.
+     */
+    void assign(const string_type& str, int n, bool be)
+    {
+        const char_type mark = (char_type)0x01;
+
+        if (be) {
+            // Append marks for begin/end of the string.
+            m_src.assign(n-1, mark);
+            m_src.append(str);
+            m_src.append(n-1, mark);
+        } else if ((int)str.length() < n) {
+            // Pad marks when the string is shorter than n.
+            m_src.assign(str);
+            m_src.append(n - str.length(), mark);
+        } else {
+            m_src.assign(str);
+        }
+
+        m_size = 0;
+        if (pack_ngrams(m_src.data(), m_src.length(), n, m_codes)) {
+            // Identical n-grams adjoin in the sorted integers.
+            const int bits = 8 * sizeof(char_type);
+            const uint64_t mask = ((uint64_t)1 << bits) - 1;
+            for (size_type i = 0;i < m_codes.size();) {
+                size_type j = i + 1;
+                while (j < m_codes.size() && m_codes[j] == m_codes[i]) {
+                    ++j;
+                }
+                for (int k = 1;k <= (int)(j - i);++k) {
+                    string_type& ngram = next();
+                    ngram.assign(n, mark);
+                    uint64_t v = m_codes[i];
+                    for (int l = n-1;0 <= l;--l, v >>= bits) {
+                        ngram[l] = ngram_letter<char_type>(v & mask);
+                    }
+                    append_number(ngram, k);
+                }
+                i = j;
+            }
+
+        } else {
+            // Sort the positions of n-grams so that identical n-grams adjoin.
+            m_pos.clear();
+            for (size_type i = 0;i + n <= m_src.length();++i) {
+                m_pos.push_back(i);
+            }
+            std::sort(m_pos.begin(), m_pos.end(), less_ngram(m_src.data(), n));
+
+            for (size_type i = 0;i < m_pos.size();) {
+                size_type j = i + 1;
+                while (j < m_pos.size() &&
+                    traits_type::compare(&m_src[m_pos[i]], &m_src[m_pos[j]], n) == 0) {
+                    ++j;
+                }
+                for (int k = 1;k <= (int)(j - i);++k) {
+                    string_type& ngram = next();
+                    ngram.assign(m_src, m_pos[i], n);
+                    append_number(ngram, k);
+                }
+                i = j;
+            }
+        }
+    }
+
+protected:
+    string_type& next()
+    {
+        if (m_size == m_ngrams.size()) {
+            m_ngrams.push_back(string_type());
+        }
+        return m_ngrams[m_size++];
+    }
+
+    static void append_number(string_type& ngram, int k)
+    {
+        // Append the decimal digits of the number of the occurrence.
+        if (1 < k) {
+            char digits[16];
+            int i = 0;
+            for (;k;k /= 10) {
+                digits[i++] = (char)('0' + k % 10);
+            }
+            while (0 < i) {
+                ngram += (char_type)digits[--i];
+            }
+        }
+    }
+};
+
 /**
  * Obtain a set of letter n-grams in a string.
  *  @param  str     The string.
@@ -47,6 +376,7 @@ namespace simstring
  *  @param  n       The unit of n-grams.
  *  @param  be      \c true to generate n-grams that encode begin and end of
  *                  a string.
+ *  @see    ngram_buffer
  */
 template <
     class string_type,
@@ -60,45 +390,9 @@ ngrams(
     bool be
     )
 {
-    typedef typename string_type::value_type char_type;
-    typedef std::basic_stringstream<char_type> stringstream_type;
-    typedef std::map<string_type, int> ngram_stat_type;
-    const char_type mark = (char_type)0x01;
-
-    string_type src;
-    if (be) {
-        // Append marks for begin/end of the string.
-        for (int i = 0;i < n-1;++i) src += mark;
-        src += str;
-        for (int i = 0;i < n-1;++i) src += mark;
-    } else if ((int)str.length() < n) {
-        // Pad marks when the string is shorter than n.
-        src = str;
-        for (int i = 0;i < n - (int)str.length();++i) {
-            src += mark;
-        }
-    } else {
-        src = str;
-    }
-    
-    // Count n-grams in the string.
-    ngram_stat_type stat;
-    for (typename string_type::size_type i = 0;i < src.length()-n+1;++i) {
-        string_type ngram = src.substr(i, n);
-        ++stat[ngram];
-    }
-
-    // Convert the n-gram stat into a set.
-    typename ngram_stat_type::const_iterator it;
-    for (it = stat.begin();it != stat.end();++it) {
-        *ins = it->first;
-        // Append numbers if the same n-gram occurs more than once.
-        for (int i = 2;i <= it->second;++i) {
-            stringstream_type ss;
-            ss << it->first << i;
-            *ins = ss.str();
-        }
-    }
+    ngram_buffer<string_type> buf;
+    buf.assign(str, n, be);
+    std::copy(buf.begin(), buf.end(), ins);
 }
 
 /**
@@ -171,6 +465,18 @@ public:
     {
         ngrams(str, ins, m_n, m_be);
     }
+
+    /**
+     * Obtain a set of letter n-grams in a string, reusing the memory of an
+     *  n-gram array.
+     *  @param  str     The string.
+     *  @param  buf     The n-gram array that receives the n-grams.
+     */
+    template <class string_type>
+    void operator()(const string_type& str, ngram_buffer<string_type>& buf) const
+    {
+        buf.assign(str, m_n, m_be);
+    }
 };
 
 };
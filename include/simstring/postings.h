@@ -0,0 +1,498 @@
+/*
+ *      Block-packed encoding of posting lists.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_POSTINGS_H__
+#define __SIMSTRING_POSTINGS_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "intersection.h"
+
+namespace simstring
+{
+
+/**
+ * Parameters of the block-packed encoding of posting lists.
+ *
+ *  A posting list (an ascending array of SIDs) with posting_min_blocked
+ *  or more SIDs is split into blocks of posting_block_size SIDs. A block
+ *  stores its first SID in the block header, and the differences between
+ *  adjacent SIDs packed with the minimum bit width that represents the
+ *  largest difference in the block. A list is encoded into 32-bit words:
+ *
+ *  - num:          the number of SIDs.
+ *  - first[B]:     the first SID of each block.
+ *  - offset[B]:    the offset, in words from the packed area, of each block.
+ *  - width[B]:     the bit width of each block (a byte per block, padded
+ *                  to a multiple of four bytes).
+ *  - packed[]:     the packed differences.
+ *
+ *  A shorter list is stored as \c num followed by the SIDs.
+ *
+ *  A list with a skip index is stored as \c num followed by the SIDs and,
+ *  if the list has posting_min_skipped or more SIDs, by the first SID of
+ *  every block of posting_block_size SIDs.
+ */
+enum {
+    /// The number of SIDs in a block.
+    posting_block_size = 128,
+    /// The minimum number of SIDs in a posting list to be block-packed.
+    posting_min_blocked = 16,
+    /// The minimum number of SIDs in a posting list to have a skip index.
+    posting_min_skipped = 1024,
+};
+
+/**
+ * Encodes a posting list with a skip index.
+ *  @param  values      The pointer to the ascending array of SIDs.
+ *  @param  n           The number of SIDs.
+ *  @param  out         The array that receives the encoded words.
+ */
+template <class value_type>
+inline void encode_skip_postings(const value_type* values, size_t n, std::vector<uint32_t>& out)
+{
+    out.clear();
+    out.push_back((uint32_t)n);
+    out.insert(out.end(), values, values + n);
+    if (posting_min_skipped <= n) {
+        for (size_t i = 0;i < n;i += posting_block_size) {
+            out.push_back((uint32_t)values[i]);
+        }
+    }
+}
+
+/**
+ * Finds the block that may contain a SID.
+ *  @param  first       The first SIDs of the blocks.
+ *  @param  num_blocks  The number of blocks.
+ *  @param  value       The SID.
+ *  @param  from        The block number from which the search starts.
+ *  @return uint32_t    The last block whose first SID is not greater than
+ *                      the SID, or \c num_blocks if the SID is smaller than
+ *                      the first SID of the block \c from.
+ */
+template <class value_type>
+inline uint32_t find_block(
+    const uint32_t* first,
+    uint32_t num_blocks,
+    value_type value,
+    uint32_t from
+    )
+{
+    const uint32_t* last = first + num_blocks;
+    const uint32_t* p = gallop(first + from, last, (uint32_t)value);
+    if (p != last && *p == value) {
+        return (uint32_t)(p - first);
+    }
+    if (p == first + from) {
+        return num_blocks;
+    }
+    return (uint32_t)(p - first) - 1;
+}
+
+/**
+ * Encodes a posting list.
+ *  @param  values      The pointer to the ascending array of SIDs.
+ *  @param  n           The number of SIDs.
+ *  @param  out         The array that receives the encoded words.
+ */
+template <class value_type>
+inline void encode_postings(const value_type* values, size_t n, std::vector<uint32_t>& out)
+{
+    out.clear();
+    out.push_back((uint32_t)n);
+    if (n < posting_min_blocked) {
+        out.insert(out.end(), values, values + n);
+        return;
+    }
+
+    const size_t num_blocks = (n + posting_block_size - 1) / posting_block_size;
+    const size_t first = 1, offset = first + num_blocks;
+    const size_t width = offset + num_blocks;
+    const size_t packed = width + (num_blocks + 3) / 4;
+    out.resize(packed, 0);
+
+    for (size_t b = 0;b < num_blocks;++b) {
+        const value_type* v = values + b * posting_block_size;
+        const size_t m = std::min((size_t)posting_block_size, n - b * posting_block_size);
+
+        // Find the bit width for the largest difference.
+        uint32_t largest = 0;
+        for (size_t k = 1;k < m;++k) {
+            largest = std::max(largest, (uint32_t)(v[k] - v[k-1]));
+        }
+        int w = 0;
+        while (w < 32 && (largest >> w)) {
+            ++w;
+        }
+
+        const size_t begin = out.size();
+        out[first + b] = (uint32_t)v[0];
+        out[offset + b] = (uint32_t)(begin - packed);
+        reinterpret_cast<uint8_t*>(&out[width])[b] = (uint8_t)w;
+
+        // Pack the differences.
+        out.resize(begin + ((m - 1) * w + 31) / 32, 0);
+        uint32_t* p = &out[0] + begin;
+        for (size_t k = 1;k < m;++k) {
+            const uint32_t d = (uint32_t)(v[k] - v[k-1]);
+            const size_t bit = (k - 1) * w;
+            const int shift = (int)(bit & 31);
+            p[bit >> 5] |= d << shift;
+            if (32 < shift + w) {
+                p[(bit >> 5) + 1] |= d >> (32 - shift);
+            }
+        }
+    }
+}
+
+/**
+ * Unpacks differences of a constant bit width.
+ */
+template <int W>
+inline void unpack_deltas(const uint32_t* in, int n, uint32_t* out)
+{
+    const uint32_t mask = (uint32_t)(((uint64_t)1 << W) - 1);
+    for (int k = 0;k < n;++k) {
+        const int bit = k * W;
+        const uint32_t* p = in + (bit >> 5);
+        const int shift = bit & 31;
+        uint32_t v = p[0] >> shift;
+        if (32 < shift + W) {
+            v |= p[1] << (32 - shift);
+        }
+        out[k] = v & mask;
+    }
+}
+
+/**
+ * Unpacks differences; the bit width is dispatched to a specialized loop.
+ *  @param  in          The packed differences.
+ *  @param  w           The bit width.
+ *  @param  n           The number of differences.
+ *  @param  out         The array that receives the differences.
+ */
+inline void unpack_deltas(const uint32_t* in, int w, int n, uint32_t* out)
+{
+    switch (w) {
+    case 0: std::fill(out, out + n, 0); break;
+    case 1: unpack_deltas<1>(in, n, out); break;
+    case 2: unpack_deltas<2>(in, n, out); break;
+    case 3: unpack_deltas<3>(in, n, out); break;
+    case 4: unpack_deltas<4>(in, n, out); break;
+    case 5: unpack_deltas<5>(in, n, out); break;
+    case 6: unpack_deltas<6>(in, n, out); break;
+    case 7: unpack_deltas<7>(in, n, out); break;
+    case 8: unpack_deltas<8>(in, n, out); break;
+    case 9: unpack_deltas<9>(in, n, out); break;
+    case 10: unpack_deltas<10>(in, n, out); break;
+    case 11: unpack_deltas<11>(in, n, out); break;
+    case 12: unpack_deltas<12>(in, n, out); break;
+    case 13: unpack_deltas<13>(in, n, out); break;
+    case 14: unpack_deltas<14>(in, n, out); break;
+    case 15: unpack_deltas<15>(in, n, out); break;
+    case 16: unpack_deltas<16>(in, n, out); break;
+    case 17: unpack_deltas<17>(in, n, out); break;
+    case 18: unpack_deltas<18>(in, n, out); break;
+    case 19: unpack_deltas<19>(in, n, out); break;
+    case 20: unpack_deltas<20>(in, n, out); break;
+    case 21: unpack_deltas<21>(in, n, out); break;
+    case 22: unpack_deltas<22>(in, n, out); break;
+    case 23: unpack_deltas<23>(in, n, out); break;
+    case 24: unpack_deltas<24>(in, n, out); break;
+    case 25: unpack_deltas<25>(in, n, out); break;
+    case 26: unpack_deltas<26>(in, n, out); break;
+    case 27: unpack_deltas<27>(in, n, out); break;
+    case 28: unpack_deltas<28>(in, n, out); break;
+    case 29: unpack_deltas<29>(in, n, out); break;
+    case 30: unpack_deltas<30>(in, n, out); break;
+    case 31: unpack_deltas<31>(in, n, out); break;
+    case 32: unpack_deltas<32>(in, n, out); break;
+    }
+}
+
+/**
+ * Computes the prefix sums of an array in place.
+ *  @param  x           The array whose first element is the base value.
+ *  @param  n           The number of elements.
+ */
+inline void prefix_sum(uint32_t* x, int n)
+{
+    int k = 1;
+#ifdef  SIMSTRING_USE_X86_SIMD
+    __m128i carry = _mm_set1_epi32((int)x[0]);
+    for (;k + 4 <= n;k += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + k));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(x + k), v);
+        carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+#endif/*SIMSTRING_USE_X86_SIMD*/
+    for (;k < n;++k) {
+        x[k] += x[k-1];
+    }
+}
+
+/**
+ * A read-only view of a block-packed posting list.
+ *  @param  value_type  The type of SIDs (a 32-bit unsigned integer).
+ */
+template <class value_type>
+class block_list
+{
+protected:
+    const uint32_t* m_first;
+    const uint32_t* m_offset;
+    const uint8_t*  m_width;
+    const uint32_t* m_packed;
+    uint32_t        m_num;
+    uint32_t        m_num_blocks;
+
+public:
+    /**
+     * Constructs a view.
+     *  @param  data        The pointer to an encoded posting list with
+     *                      posting_min_blocked or more SIDs (\c NULL for
+     *                      an empty list).
+     */
+    block_list(const void* data)
+    {
+        static const uint32_t empty = 0;
+        const uint32_t* p = data ? reinterpret_cast<const uint32_t*>(data) : &empty;
+        m_num = p[0];
+        m_num_blocks = (m_num + posting_block_size - 1) / posting_block_size;
+        m_first = p + 1;
+        m_offset = m_first + m_num_blocks;
+        m_width = reinterpret_cast<const uint8_t*>(m_offset + m_num_blocks);
+        m_packed = m_offset + m_num_blocks + (m_num_blocks + 3) / 4;
+    }
+
+    /**
+     * Returns the number of SIDs.
+     */
+    uint32_t size() const
+    {
+        return m_num;
+    }
+
+    /**
+     * Returns the number of blocks.
+     */
+    uint32_t num_blocks() const
+    {
+        return m_num_blocks;
+    }
+
+    /**
+     * Decodes a block.
+     *  @param  b           The block number.
+     *  @param  out         The array of posting_block_size elements that
+     *                      receives the SIDs.
+     *  @return int         The number of SIDs in the block.
+     */
+    int decode_block(uint32_t b, value_type* out) const
+    {
+        const int n = (int)std::min(
+            (uint32_t)posting_block_size, m_num - b * posting_block_size);
+        out[0] = m_first[b];
+        unpack_deltas(m_packed + m_offset[b], m_width[b], n - 1, out + 1);
+        prefix_sum(out, n);
+        return n;
+    }
+
+    /**
+     * Decodes all SIDs.
+     *  @param  out         The array of size() elements that receives the
+     *                      SIDs.
+     */
+    void decode(value_type* out) const
+    {
+        for (uint32_t b = 0;b < m_num_blocks;++b) {
+            out += decode_block(b, out);
+        }
+    }
+
+    /**
+     * Returns the first SIDs of the blocks.
+     */
+    const uint32_t* first() const
+    {
+        return m_first;
+    }
+
+    /**
+     * Tests whether the list contains a SID.
+     *  @param  value       The SID.
+     *  @return bool        \c true if the list contains the SID.
+     */
+    bool contains(value_type value) const
+    {
+        const uint32_t b = find_block(m_first, m_num_blocks, value, 0);
+        if (b == m_num_blocks) {
+            return false;
+        }
+        value_type buffer[posting_block_size];
+        const int n = decode_block(b, buffer);
+        return std::binary_search(buffer, buffer + n, value);
+    }
+};
+
+/**
+ * Tests whether a posting list with a skip index contains a SID.
+ *  @param  values      The pointer to the array of SIDs.
+ *  @param  num         The number of SIDs.
+ *  @param  skips       The first SIDs of the blocks.
+ *  @param  value       The SID.
+ *  @return bool        \c true if the list contains the SID.
+ */
+template <class value_type>
+inline bool skip_list_contains(
+    const value_type* values,
+    int num,
+    const uint32_t* skips,
+    value_type value
+    )
+{
+    const uint32_t num_blocks = (num + posting_block_size - 1) / posting_block_size;
+    const uint32_t b = find_block(skips, num_blocks, value, 0);
+    if (b == num_blocks) {
+        return false;
+    }
+    const value_type* first = values + b * posting_block_size;
+    const value_type* last = values + std::min((int)((b + 1) * posting_block_size), num);
+    return std::binary_search(first, last, value);
+}
+
+/**
+ * A cursor that tests the membership of ascending SIDs in a posting list.
+ *  A posting list is an array of SIDs, an array of SIDs with a skip index,
+ *  or a block-packed list. For the latter two, the first SIDs of blocks
+ *  are searched for the block that may contain a probed SID, and only the
+ *  block is scanned (and decoded if block-packed).
+ */
+template <class value_type>
+class posting_cursor
+{
+protected:
+    sorted_cursor<value_type>   m_sorted;
+    const value_type*           m_values;
+    int                         m_num;
+    const void*                 m_packed;
+    const uint32_t*             m_first;
+    uint32_t                    m_num_blocks;
+    uint32_t                    m_block;
+    const value_type*           m_cur;
+    const value_type*           m_last;
+    value_type                  m_buffer[posting_block_size];
+
+public:
+    /**
+     * The average distance between probes below which the skip index of
+     * an array is not used.
+     */
+    enum { dense_skip_gap = 32 };
+
+    /**
+     * Constructs a cursor.
+     *  @param  values      The pointer to the array of SIDs (used when
+     *                      \c packed is \c NULL).
+     *  @param  num         The number of SIDs.
+     *  @param  packed      The pointer to the block-packed list, or \c NULL.
+     *  @param  skips       The first SIDs of the blocks of the array, or
+     *                      \c NULL if the array has no skip index.
+     *  @param  num_probes  The expected number of probes.
+     */
+    posting_cursor(
+        const value_type* values,
+        int num,
+        const void* packed,
+        const uint32_t* skips,
+        size_t num_probes
+        )
+        : m_sorted(values, values + (packed ? 0 : num), num_probes),
+        m_values(values), m_num(num), m_packed(packed), m_first(skips),
+        m_num_blocks(0), m_block(0), m_cur(NULL), m_last(NULL)
+    {
+        if (packed) {
+            const block_list<value_type> list(packed);
+            m_first = list.first();
+            m_num_blocks = list.num_blocks();
+        } else if (skips && (size_t)num < num_probes * dense_skip_gap) {
+            // Scanning the array is faster than skipping for dense probes.
+            m_first = NULL;
+        } else if (skips) {
+            m_num_blocks = (num + posting_block_size - 1) / posting_block_size;
+        }
+    }
+
+    /**
+     * Tests whether the list contains a SID.
+     *  @param  value       The SID, which must not be smaller than the SID
+     *                      of the previous call.
+     *  @return bool        \c true if the list contains the SID.
+     */
+    bool contains(value_type value)
+    {
+        if (!m_first) {
+            return m_sorted.contains(value);
+        }
+
+        // Move to the block that may contain the SID unless the current
+        // block does.
+        if (m_last == NULL || (*(m_last - 1) < value && m_block + 1 < m_num_blocks)) {
+            const uint32_t b = find_block(
+                m_first, m_num_blocks, value, m_last == NULL ? 0 : m_block + 1);
+            if (b == m_num_blocks) {
+                return false;
+            }
+            m_block = b;
+            if (m_packed) {
+                m_cur = m_buffer;
+                m_last = m_buffer + block_list<value_type>(m_packed).decode_block(b, m_buffer);
+            } else {
+                m_cur = m_values + b * posting_block_size;
+                m_last = m_values + std::min((int)((b + 1) * posting_block_size), m_num);
+            }
+        }
+
+        m_cur = scan(m_cur, m_last, value);
+        return (m_cur != m_last && *m_cur == value);
+    }
+};
+
+};
+
+#endif/*__SIMSTRING_POSTINGS_H__*/
@@ -33,9 +33,13 @@
 #ifndef __SIMSTRING_H__
 #define __SIMSTRING_H__
 
+#include <limits.h>
 #include <stdint.h>
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -44,18 +48,22 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "ngram.h"
 #include "measure.h"
 #include "cdbpp.h"
+#include "intersection.h"
+#include "postings.h"
 #include "memory_mapped_file.h"
+#include "thread_pool.h"
 
 #define	SIMSTRING_NAME           "SimString"
 #define	SIMSTRING_COPYRIGHT      "Copyright (c) 2009-2011 Naoaki Okazaki"
 #define	SIMSTRING_MAJOR_VERSION  1
 #define SIMSTRING_MINOR_VERSION  1
-#define SIMSTRING_STREAM_VERSION 2
+#define SIMSTRING_STREAM_VERSION 3
 
 /** 
  * \addtogroup api SimString C++ API
@@ -71,6 +79,120 @@ enum {
     BYTEORDER_CHECK = 0x62445371,
 };
 
+/**
+ * Options of the database format.
+ *  A database built with any of these options has a file header of the
+ *  stream version 3, which stores the options; the other databases keep
+ *  the header of the stream version 2.
+ */
+enum {
+    /// Store n-grams as 64-bit fingerprints in the indices.
+    FORMAT_FINGERPRINT = 0x0001,
+    /// Store posting lists in the block-packed encoding.
+    FORMAT_COMPRESSED = 0x0002,
+    /// Store skip indices of long posting lists (ignored when the posting
+    /// lists are block-packed, whose block headers serve the purpose).
+    FORMAT_SKIP_INDEX = 0x0004,
+    /// Store the indices of all sizes in the master file, which is then
+    /// the only file of the database.
+    FORMAT_SINGLE_FILE = 0x0008,
+    /// Store the length of each string (a 32-bit integer counting the
+    /// characters) in front of the string in the master file.
+    FORMAT_STRING_LENGTH = 0x0010,
+    /// Align the indices of FORMAT_SINGLE_FILE to huge pages instead of
+    /// pages, so that an index never shares a huge page with another.
+    FORMAT_HUGE_PAGE_ALIGNMENT = 0x0020,
+    /// Align strings in the master file to LARGE_GRANULARITY bytes, and
+    /// use the offsets divided by LARGE_GRANULARITY as SIDs, so that 32-bit
+    /// SIDs address a master file larger than 4 GB. The file header also
+    /// stores the file size in 64 bits.
+    FORMAT_LARGE = 0x0040,
+    /// Use sequential numbers 0, 1, ... of strings as SIDs, and store the
+    /// offsets and lengths of strings in a table of the master file.
+    FORMAT_DENSE_ID = 0x0080,
+};
+
+enum {
+    /// The alignment of the indices in a database of FORMAT_SINGLE_FILE.
+    PARTITION_ALIGNMENT = 4096,
+    /// The alignment of the indices with FORMAT_HUGE_PAGE_ALIGNMENT.
+    HUGE_PAGE_ALIGNMENT = 2 * 1024 * 1024,
+    /// The unit of SIDs with FORMAT_LARGE.
+    LARGE_GRANULARITY = 8,
+};
+
+/**
+ * Options of opening a database.
+ */
+enum {
+    /// Read the database into memory when opening it, so that the first
+    /// queries do not wait for the disk.
+    OPEN_POPULATE = 0x0001,
+    /// Lock the database in memory; this may require a privilege or a
+    /// larger limit of locked memory (RLIMIT_MEMLOCK).
+    OPEN_LOCK = 0x0002,
+    /// Advise the OS that the database is accessed randomly, which
+    /// suppresses useless readahead.
+    OPEN_RANDOM = 0x0004,
+    /// Copy the database into anonymous memory backed by huge pages, which
+    /// reduces TLB misses of random accesses (Linux only). The memory is
+    /// not shared with other processes; the database is mapped as usual
+    /// when huge pages are unavailable.
+    OPEN_HUGE_PAGES = 0x0008,
+};
+
+/**
+ * Computes the 64-bit fingerprint of an n-gram.
+ *  This is MurmurHash64A implemented by Austin Appleby. Like the hash
+ *  function of CDB++, the fingerprint depends on the byte order.
+ *  @param  ngram       The n-gram.
+ *  @return uint64_t    The fingerprint.
+ */
+template <class ngram_type>
+inline uint64_t ngram_fingerprint(const ngram_type& ngram)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const uint64_t seed = 0x87654321;
+
+    size_t size = sizeof(ngram[0]) * ngram.length();
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(ngram.data());
+    uint64_t h = seed ^ (size * m);
+
+    // Mix 8 bytes at a time into the hash.
+    while (size >= 8) {
+        uint64_t k;
+        std::memcpy(&k, data, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+        size -= 8;
+    }
+
+    // Handle the last few bytes.
+    switch (size) {
+    case 7: h ^= (uint64_t)data[6] << 48;
+    case 6: h ^= (uint64_t)data[5] << 40;
+    case 5: h ^= (uint64_t)data[4] << 32;
+    case 4: h ^= (uint64_t)data[3] << 24;
+    case 3: h ^= (uint64_t)data[2] << 16;
+    case 2: h ^= (uint64_t)data[1] << 8;
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 /**
  * Query types.
  */
@@ -127,16 +249,379 @@ protected:
     typedef std::vector<string_type> ngrams_type;
     /// The vector type of values associated with an n-gram.
     typedef std::vector<value_type> values_type;
-    /// The type implementing an index (associations from n-grams to values).
-    typedef std::map<string_type, values_type> hashdb_type;
+    /// The type of the vocabulary that numbers distinct n-grams.
+    typedef std::unordered_map<string_type, uint32_t> vocabulary_type;
+    /// An association between an n-gram (its number) and a value.
+    struct posting_type
+    {
+        uint32_t    ngram;
+        value_type  value;
+
+        posting_type(uint32_t n, const value_type& v) : ngram(n), value(v)
+        {
+        }
+
+        static bool less_ngram(const posting_type& x, const posting_type& y)
+        {
+            return (x.ngram < y.ngram);
+        }
+
+        static bool less_ngram_value(const posting_type& x, const posting_type& y)
+        {
+            return (x.ngram < y.ngram || (x.ngram == y.ngram && x.value < y.value));
+        }
+    };
+    /// The type of an array of postings.
+    typedef std::vector<posting_type> postings_type;
+    /**
+     * The postings of the strings with the same number of n-grams.
+     *  A string with \c k n-grams appends the numbers of its \c k n-grams
+     *  to \c ngrams and its value to \c values, so that the n-gram at
+     *  \c ngrams[j] is associated with the value at \c values[j/k].
+     *  \c spilled counts the strings whose postings are in sorted runs.
+     */
+    struct partition_type
+    {
+        std::vector<uint32_t>   ngrams;
+        values_type             values;
+        uint64_t                spilled;
+
+        partition_type() : spilled(0)
+        {
+        }
+
+        bool empty() const
+        {
+            return values.empty() && spilled == 0;
+        }
+    };
     /// The vector of indices for different n-gram sizes.
-    typedef std::vector<hashdb_type> indices_type;
+    typedef std::vector<partition_type> indices_type;
+    /// The directory of the indices (pairs of offset and size).
+    typedef std::vector<uint64_t> directory_type;
+
+    /// The comparator of n-grams by their numbers in the vocabulary.
+    struct less_ngram_string
+    {
+        const std::vector<const string_type*>& ngrams;
+
+        less_ngram_string(const std::vector<const string_type*>& v) : ngrams(v)
+        {
+        }
+
+        bool operator()(uint32_t x, uint32_t y) const
+        {
+            return (*ngrams[x] < *ngrams[y]);
+        }
+    };
+
+    /**
+     * A temporary file storing a sorted run of postings.
+     *  A run consists of sections for sizes in the ascending order, which
+     *  is terminated by a zero size. A section has the size and the number
+     *  of n-grams, followed by every n-gram (the length and characters) and
+     *  its values (the number and values) in the ascending order of n-grams.
+     */
+    struct run_file
+    {
+        /// The file name.
+        std::string                 name;
+        /// The offsets of the sections of sizes (-1 for sizes without one).
+        std::vector<std::streamoff> sections;
+
+        bool has(uint32_t size) const
+        {
+            return (size <= sections.size() && 0 <= sections[size-1]);
+        }
+    };
+
+    /**
+     * A reader of a section of a run.
+     */
+    struct run_type
+    {
+        std::ifstream   ifs;
+        uint32_t        size;
+        uint64_t        remaining;
+        string_type     ngram;
+        values_type     values;
+
+        run_type() : size(0), remaining(0)
+        {
+        }
+
+        bool open(const std::string& name, std::streamoff offset)
+        {
+            ifs.open(name.c_str(), std::ios::binary);
+            ifs.seekg(offset);
+            return !ifs.fail() && next_section();
+        }
+
+        bool next_section()
+        {
+            size = 0;
+            remaining = 0;
+            ifs.read(reinterpret_cast<char*>(&size), sizeof(size));
+            if (size != 0) {
+                ifs.read(reinterpret_cast<char*>(&remaining), sizeof(remaining));
+            }
+            return !ifs.fail();
+        }
+
+        bool next()
+        {
+            if (remaining == 0) {
+                return false;
+            }
+            --remaining;
+
+            uint32_t n = 0;
+            ifs.read(reinterpret_cast<char*>(&n), sizeof(n));
+            ngram.resize(n);
+            if (0 < n) {
+                ifs.read(reinterpret_cast<char*>(&ngram[0]), sizeof(char_type) * n);
+            }
+            ifs.read(reinterpret_cast<char*>(&n), sizeof(n));
+            values.resize(n);
+            if (0 < n) {
+                ifs.read(reinterpret_cast<char*>(&values[0]), sizeof(value_type) * n);
+            }
+            return !ifs.fail();
+        }
+    };
+
+    /**
+     * Enumerates sorted postings in memory grouped by n-grams.
+     */
+    class postings_source
+    {
+    protected:
+        typename postings_type::const_iterator m_it;
+        typename postings_type::const_iterator m_last;
+        const std::vector<uint32_t>& m_order;
+        const std::vector<const string_type*>& m_ngrams;
+        values_type m_values;
+
+    public:
+        postings_source(
+            const postings_type& postings,
+            const std::vector<uint32_t>& order,
+            const std::vector<const string_type*>& ngrams
+            ) : m_it(postings.begin()), m_last(postings.end()),
+            m_order(order), m_ngrams(ngrams)
+        {
+        }
+
+        bool next(const string_type*& ngram, const values_type*& values)
+        {
+            if (m_it == m_last) {
+                return false;
+            }
+            const uint32_t n = m_it->ngram;
+            m_values.clear();
+            for (;m_it != m_last && m_it->ngram == n;++m_it) {
+                m_values.push_back(m_it->value);
+            }
+            ngram = m_ngrams[m_order[n]];
+            values = &m_values;
+            return true;
+        }
+    };
+
+    /**
+     * Enumerates the postings of a size in sorted runs grouped by n-grams.
+     *  The values of an n-gram are concatenated in the order of the runs,
+     *  which is the order of insertion.
+     */
+    class merge_source
+    {
+    protected:
+        const std::vector<run_file>& m_files;
+        std::vector<size_t> m_ids;
+        std::vector<run_type> m_runs;
+        std::vector<size_t> m_heap;
+        string_type m_ngram;
+        values_type m_values;
+        const std::string* m_failed;
+
+        struct greater_run
+        {
+            const std::vector<run_type>& runs;
+
+            greater_run(const std::vector<run_type>& r) : runs(r)
+            {
+            }
+
+            bool operator()(size_t x, size_t y) const
+            {
+                const string_type& a = runs[x].ngram;
+                const string_type& b = runs[y].ngram;
+                return (b < a || (a == b && y < x));
+            }
+        };
+
+    public:
+        merge_source(const std::vector<run_file>& files, uint32_t size)
+            : m_files(files), m_failed(NULL)
+        {
+            for (size_t r = 0;r < files.size();++r) {
+                if (files[r].has(size)) {
+                    m_ids.push_back(r);
+                }
+            }
+
+            // Open the runs at their sections of the size.
+            m_runs.resize(m_ids.size());
+            for (size_t k = 0;k < m_ids.size();++k) {
+                const run_file& file = files[m_ids[k]];
+                if (!m_runs[k].open(file.name, file.sections[size-1]) || m_runs[k].size != size) {
+                    m_failed = &file.name;
+                    return;
+                }
+                if (m_runs[k].next()) {
+                    m_heap.push_back(k);
+                }
+            }
+            std::make_heap(m_heap.begin(), m_heap.end(), greater_run(m_runs));
+        }
+
+        bool next(const string_type*& ngram, const values_type*& values)
+        {
+            if (m_heap.empty() || m_failed != NULL) {
+                return false;
+            }
+
+            // Pop the runs at the smallest n-gram in the order of the runs.
+            m_ngram = m_runs[m_heap.front()].ngram;
+            m_values.clear();
+            while (!m_heap.empty() && m_runs[m_heap.front()].ngram == m_ngram) {
+                std::pop_heap(m_heap.begin(), m_heap.end(), greater_run(m_runs));
+                run_type& run = m_runs[m_heap.back()];
+                m_values.insert(m_values.end(), run.values.begin(), run.values.end());
+                if (run.next()) {
+                    std::push_heap(m_heap.begin(), m_heap.end(), greater_run(m_runs));
+                } else {
+                    m_heap.pop_back();
+                }
+            }
+            ngram = &m_ngram;
+            values = &m_values;
+            return true;
+        }
+
+        /**
+         * Returns the name of a run that could not be read.
+         *  @return const std::string*  The name, or \c NULL.
+         */
+        const std::string* failed()
+        {
+            for (size_t k = 0;m_failed == NULL && k < m_runs.size();++k) {
+                if (m_runs[k].ifs.fail()) {
+                    m_failed = &m_files[m_ids[k]].name;
+                }
+            }
+            return m_failed;
+        }
+    };
+
+    /// The number of runs that triggers merging them into a run.
+    enum { max_runs = 64 };
+
+    /// The ranks of the n-grams in memory for storing the indices.
+    struct ranking_type
+    {
+        /// The ranks of the n-grams.
+        std::vector<uint32_t>   rank;
+        /// The numbers of the n-grams in the ascending order.
+        std::vector<uint32_t>   order;
+    };
+
+    // A job that generates the n-grams of keys on a thread pool.
+    class ngram_job : public thread_pool::job
+    {
+    public:
+        const ngram_generator_type& gen;
+        const std::vector<string_type>& keys;
+        std::vector<ngrams_type>& ngrams;
+
+        ngram_job(
+            const ngram_generator_type& gen_,
+            const std::vector<string_type>& keys_,
+            std::vector<ngrams_type>& ngrams_
+            )
+            : gen(gen_), keys(keys_), ngrams(ngrams_)
+        {
+        }
+
+        void run(int index, int /*worker*/)
+        {
+            ngrams[index].clear();
+            gen(keys[index], std::back_inserter(ngrams[index]));
+        }
+    };
+
+    // A job that stores the indices of sizes on a thread pool.
+    class store_job : public thread_pool::job
+    {
+    public:
+        const ngramdb_writer_base& db;
+        const std::vector<std::string>& names;
+        const ranking_type& rk;
+        // The sizes (minus one) to be processed, in the order of execution.
+        std::vector<int> sizes;
+        // The file sizes and error messages (indexed by size minus one).
+        directory_type file_sizes;
+        std::vector<std::string> errors;
+
+        store_job(
+            const ngramdb_writer_base& db_,
+            const std::vector<std::string>& names_,
+            const ranking_type& rk_
+            )
+            : db(db_), names(names_), rk(rk_),
+            file_sizes(names_.size(), 0), errors(names_.size())
+        {
+        }
+
+        void run(int index, int /*worker*/)
+        {
+            const int i = sizes[index];
+            std::stringstream es;
+            if (!db.store_index(names[i], i, rk, file_sizes[i], es)) {
+                errors[i] = es.str();
+            }
+        }
+    };
 
 protected:
     /// The vector of indices.
     indices_type m_indices;
+    /// The vocabulary of n-grams.
+    vocabulary_type m_vocabulary;
+    /// The n-grams in the vocabulary, indexed by their numbers.
+    std::vector<const string_type*> m_ngrams;
+    /// The buffer for the n-grams of a key.
+    ngrams_type m_buffer;
+    /// The buffers for the n-grams of keys inserted at a time.
+    std::vector<ngrams_type> m_batch;
+    /// Whether the values have been inserted in the ascending order.
+    bool m_ascending;
+    /// The approximate number of bytes used by the postings in memory.
+    size_t m_usage;
+    /// The memory budget for the postings (zero for no limit).
+    size_t m_budget;
+    /// The prefix of the names of temporary files.
+    std::string m_temp;
+    /// The temporary files storing sorted runs.
+    std::vector<run_file> m_runs;
+    /// The serial number of the next temporary file.
+    int m_serial;
+    /// The thread pool for building the database (NULL for serial).
+    thread_pool* m_pool;
     /// The n-gram generator.
     const ngram_generator_type& m_gen;
+    /// The options of the database format.
+    int m_flags;
     /// The error message.
     std::stringstream m_error;
 
@@ -144,9 +629,11 @@ public:
     /**
      * Constructs an object.
      *  @param  gen             The n-gram generator.
+     *  @param  flags           The options of the database format.
      */
-    ngramdb_writer_base(const ngram_generator_type& gen)
-        : m_gen(gen)
+    ngramdb_writer_base(const ngram_generator_type& gen, int flags = 0)
+        : m_ascending(true), m_usage(0), m_budget(0), m_serial(0),
+        m_pool(NULL), m_gen(gen), m_flags(flags)
     {
     }
 
@@ -155,6 +642,7 @@ public:
      */
     virtual ~ngramdb_writer_base()
     {
+        remove_runs();
     }
 
     /**
@@ -163,9 +651,46 @@ public:
     void clear()
     {
         m_indices.clear();
+        m_vocabulary.clear();
+        m_ngrams.clear();
+        m_ascending = true;
+        m_usage = 0;
+        remove_runs();
         m_error.str("");
     }
 
+    /**
+     * Limits the memory for postings by spilling them to temporary files.
+     *  When the postings in memory exceed the budget, insert() sorts them
+     *  into a run written to a temporary file and frees the memory; store()
+     *  merges the runs into the indices and removes the files. The budget
+     *  is compared with an estimate of the n-grams and postings; sorting a
+     *  run needs \c sizeof(posting_type) bytes for every posting of a size
+     *  in addition.
+     *  @param  budget      The budget in bytes (zero for no limit).
+     *  @param  temp        The prefix of the names of temporary files, to
+     *                      which sequential numbers are appended.
+     */
+    void set_memory_budget(size_t budget, const std::string& temp)
+    {
+        m_budget = budget;
+        m_temp = temp;
+    }
+
+    /**
+     * Sets a thread pool for building the database in parallel.
+     *  The pool generates the n-grams of strings inserted at a time, and
+     *  store() writes the indices of different sizes in parallel; the
+     *  single-file format needs the prefix of temporary files, in which the
+     *  indices are built before being appended. The database is identical
+     *  to that built without the pool.
+     *  @param  pool        The thread pool (\c NULL for serial building).
+     */
+    void set_thread_pool(thread_pool* pool)
+    {
+        m_pool = pool;
+    }
+
     /**
      * Checks whether the database is empty.
      *  @return bool    \c true if the database is empty, \c false otherwise.
@@ -175,6 +700,15 @@ public:
         return m_indices.empty();
     }
 
+    /**
+     * Returns the options of the database format.
+     *  @return int     The options (a combination of FORMAT_* values).
+     */
+    int flags() const
+    {
+        return m_flags;
+    }
+
     /**
      * Returns the maximum length of keys in the n-gram database.
      *  @return int     The maximum length of keys.
@@ -210,8 +744,61 @@ public:
     bool insert(const string_type& key, const value_type& value)
     {
         // Generate n-grams from the key string.
-        ngrams_type ngrams;
-        m_gen(key, std::back_inserter(ngrams));
+        m_buffer.clear();
+        m_gen(key, std::back_inserter(m_buffer));
+        return this->append(m_buffer, value);
+    }
+
+    /**
+     * Inserts strings to the n-gram database.
+     *  The n-grams of the strings are generated with the thread pool if
+     *  set, and inserted in the order of the strings.
+     *  @param  keys        The key strings.
+     *  @param  values      The values associated with the strings.
+     */
+    bool insert(const std::vector<string_type>& keys, const values_type& values)
+    {
+        this->generate(keys);
+
+        bool b = true;
+        for (size_t j = 0;j < keys.size();++j) {
+            if (!this->append(m_batch[j], values[j])) {
+                b = false;
+                if (this->fail()) {
+                    break;
+                }
+            }
+        }
+        return b;
+    }
+
+protected:
+    /**
+     * Generates the n-grams of key strings into \c m_batch.
+     *  The n-grams are generated with the thread pool if set.
+     *  @param  keys        The key strings.
+     */
+    void generate(const std::vector<string_type>& keys)
+    {
+        m_batch.resize(keys.size());
+        if (this->parallel() && 1 < keys.size()) {
+            ngram_job job(m_gen, keys, m_batch);
+            m_pool->run(job, (int)keys.size());
+        } else {
+            for (size_t j = 0;j < keys.size();++j) {
+                m_batch[j].clear();
+                m_gen(keys[j], std::back_inserter(m_batch[j]));
+            }
+        }
+    }
+
+    /**
+     * Appends the postings of a key string.
+     *  @param  ngrams      The n-grams of the key string.
+     *  @param  value       The value associated with the string.
+     */
+    bool append(const ngrams_type& ngrams, const value_type& value)
+    {
         if (ngrams.empty()) {
             return false;
         }
@@ -221,27 +808,37 @@ public:
         if (m_indices.size() < ngrams.size()) {
             m_indices.resize(ngrams.size());
         }
-        hashdb_type& index = m_indices[ngrams.size()-1];
+        partition_type& index = m_indices[ngrams.size()-1];
+        if (!index.values.empty() && value < index.values.back()) {
+            m_ascending = false;
+        }
+        index.values.push_back(value);
+        m_usage += sizeof(value_type) + sizeof(uint32_t) * ngrams.size();
 
-        // Store the associations from the n-grams to the value.
+        // Append the numbers of the n-grams; the postings are grouped by
+        // the n-grams when the index is stored.
         typename ngrams_type::const_iterator it;
         for (it = ngrams.begin();it != ngrams.end();++it) {
-            const string_type& ngram = *it;
-            typename hashdb_type::iterator iti = index.find(ngram);
-            if (iti == index.end()) {
-                // Create a new posting array.
-                values_type v(1);
-                v[0] = value;
-                index.insert(typename hashdb_type::value_type(ngram, v));
-            } else {
-                // Append the value to the existing posting array.
-                iti->second.push_back(value);
+            typename vocabulary_type::iterator itv = m_vocabulary.find(*it);
+            if (itv == m_vocabulary.end()) {
+                itv = m_vocabulary.insert(
+                    typename vocabulary_type::value_type(*it, (uint32_t)m_ngrams.size())
+                    ).first;
+                m_ngrams.push_back(&itv->first);
+                m_usage += sizeof(typename vocabulary_type::value_type) +
+                    sizeof(char_type) * (it->length() + 1) + 4 * sizeof(void*);
             }
+            index.ngrams.push_back(itv->second);
         }
 
+        // Spill the postings to a temporary file when exceeding the budget.
+        if (m_budget != 0 && m_budget < m_usage) {
+            return this->spill();
+        }
         return true;
     }
 
+public:
     /**
      * Stores the n-gram database to files.
      *  @param  name        The prefix of file names.
@@ -250,54 +847,582 @@ public:
      */
     bool store(const std::string& base)
     {
-        // Write out all the indices to files.
+        directory_type dir;
+        return this->store(base, dir);
+    }
+
+    /**
+     * Appends the n-gram database to a stream.
+     *  The index of each size starts at an offset aligned to \c align bytes,
+     *  and the directory of the indices follows the last one.
+     *  @param  ofs         The output stream opened in the binary mode.
+     *  @param  align       The alignment of the indices in bytes.
+     *  @return bool        \c true if the database is successfully stored,
+     *                      \c false otherwise.
+     */
+    bool store(std::ofstream& ofs, uint32_t align)
+    {
+        directory_type dir;
+        return this->store(ofs, align, dir) && write_directory(ofs, dir);
+    }
+
+protected:
+    /**
+     * Appends the indices to a stream, recording their regions.
+     *  @param  ofs         The output stream opened in the binary mode.
+     *  @param  align       The alignment of the indices in bytes.
+     *  @param  dir         The directory that receives the offset and size
+     *                      of the index of each size.
+     *  @return bool        \c true if the database is successfully stored,
+     *                      \c false otherwise.
+     */
+    bool store(std::ofstream& ofs, uint32_t align, directory_type& dir)
+    {
+        ranking_type rk;
+        bool b = this->prepare_store(rk);
+
+        dir.assign(2 * m_indices.size(), 0);
+        if (b && this->parallel() && !m_temp.empty()) {
+            // Build the indices in temporary files with the thread pool,
+            // and append them to the stream.
+            std::vector<std::string> names(m_indices.size());
+            for (int i = 0;i < (int)m_indices.size();++i) {
+                if (!m_indices[i].empty()) {
+                    std::stringstream ss;
+                    ss << m_temp << '.' << i+1 << ".cdb";
+                    names[i] = ss.str();
+                }
+            }
+
+            directory_type sizes;
+            b = this->store_parallel(names, rk, sizes);
+            for (int i = 0;i < (int)m_indices.size();++i) {
+                if (!names[i].empty()) {
+                    if (b) {
+                        pad(ofs, align);
+                        dir[2*i] = (uint64_t)(std::streamoff)ofs.tellp();
+                        b = this->append_file(ofs, names[i]);
+                        dir[2*i+1] = (uint64_t)(std::streamoff)ofs.tellp() - dir[2*i];
+                    }
+                    std::remove(names[i].c_str());
+                }
+            }
+        } else {
+            for (int i = 0;b && i < (int)m_indices.size();++i) {
+                if (!m_indices[i].empty()) {
+                    pad(ofs, align);
+                    dir[2*i] = (uint64_t)(std::streamoff)ofs.tellp();
+
+                    std::stringstream ss;
+                    ss << "index of size " << i+1;
+                    b = this->store_index(ofs, ss.str(), i, rk, m_error);
+                    dir[2*i+1] = (uint64_t)(std::streamoff)ofs.tellp() - dir[2*i];
+                }
+            }
+        }
+
+        remove_runs();
+        return b;
+    }
+
+    /**
+     * Stores the n-gram database to files, recording their sizes.
+     *  @param  name        The prefix of file names.
+     *  @param  dir         The directory that receives the offset (zero)
+     *                      and size of the index file of each size.
+     *  @return bool        \c true if the database is successfully stored,
+     *                      \c false otherwise.
+     */
+    bool store(const std::string& base, directory_type& dir)
+    {
+        ranking_type rk;
+        bool b = this->prepare_store(rk);
+
+        std::vector<std::string> names(m_indices.size());
         for (int i = 0;i < (int)m_indices.size();++i) {
             if (!m_indices[i].empty()) {
                 std::stringstream ss;
                 ss << base << '.' << i+1 << ".cdb";
-                bool b = this->store(ss.str(), m_indices[i]);
-                if (!b) {
-                    return false;
+                names[i] = ss.str();
+            }
+        }
+
+        // Write out all the indices to files.
+        dir.assign(2 * m_indices.size(), 0);
+        if (b && this->parallel()) {
+            directory_type sizes;
+            b = this->store_parallel(names, rk, sizes);
+            for (int i = 0;i < (int)m_indices.size();++i) {
+                dir[2*i+1] = sizes[i];
+            }
+        } else {
+            for (int i = 0;b && i < (int)m_indices.size();++i) {
+                if (!names[i].empty()) {
+                    b = this->store_index(names[i], i, rk, dir[2*i+1], m_error);
                 }
             }
         }
 
-        return true;
+        remove_runs();
+        return b;
     }
 
-protected:
-    bool store(const std::string& name, const hashdb_type& index)
+    /**
+     * Writes the directory of the indices to a stream.
+     *  The directory has the offset and size of the index of each size
+     *  (1, ..., max_size()) as a pair of 64-bit integers; both are zero for
+     *  a size without strings, and the offset is zero for an index stored
+     *  in a file of its own. A derived class may append the regions of
+     *  other data to the directory.
+     */
+    bool write_directory(std::ofstream& ofs, const directory_type& dir)
     {
-        // Open the database file with binary mode.
-        std::ofstream ofs(name.c_str(), std::ios::binary);
+        pad(ofs, sizeof(uint64_t));
+        if (!dir.empty()) {
+            ofs.write(reinterpret_cast<const char*>(&dir[0]), sizeof(dir[0]) * dir.size());
+        }
         if (ofs.fail()) {
-            m_error << "Failed to open a file for writing: " << name;
+            m_error << "Failed to write the directory of the indices.";
             return false;
         }
+        return true;
+    }
 
-        try {
-            // Open a CDB++ writer.
-            cdbpp::builder dbw(ofs);
-
-            // Put associations: n-gram -> values.
-            typename hashdb_type::const_iterator it;
-            for (it = index.begin();it != index.end();++it) {
-                // Put an association from an n-gram to its values. 
-                dbw.put(
-                    it->first.c_str(),
-                    sizeof(char_type) * it->first.length(),
-                    &it->second[0],
-                    sizeof(it->second[0]) * it->second.size()
-                    );
+    /**
+     * Ranks the n-grams in the vocabulary in the ascending order.
+     *  @param  rank        The array that receives the rank of every n-gram
+     *                      (indexed by the numbers of n-grams).
+     *  @param  order       The array that receives the numbers of n-grams
+     *                      in the ascending order.
+     */
+    void rank_ngrams(std::vector<uint32_t>& rank, std::vector<uint32_t>& order) const
+    {
+        order.resize(m_ngrams.size());
+        for (uint32_t i = 0;i < (uint32_t)order.size();++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), less_ngram_string(m_ngrams));
+
+        rank.resize(order.size());
+        for (uint32_t r = 0;r < (uint32_t)order.size();++r) {
+            rank[order[r]] = r;
+        }
+    }
+
+    /**
+     * Sorts the postings of an index by the ranks of n-grams.
+     *  The values of an n-gram stay in the order of insertion; when the
+     *  values have been inserted in the ascending order, postings are sorted
+     *  in place without the buffer of a stable sort.
+     *  @param  postings    The array that receives the sorted postings.
+     *  @param  index       The index.
+     *  @param  rank        The ranks of n-grams.
+     */
+    void sort_postings(
+        postings_type& postings,
+        const partition_type& index,
+        const std::vector<uint32_t>& rank
+        ) const
+    {
+        const size_t k = index.ngrams.size() / index.values.size();
+        postings.clear();
+        postings.reserve(index.ngrams.size());
+        for (size_t j = 0;j < index.ngrams.size();++j) {
+            postings.push_back(posting_type(rank[index.ngrams[j]], index.values[j / k]));
+        }
+
+        if (m_ascending) {
+            std::sort(postings.begin(), postings.end(), posting_type::less_ngram_value);
+        } else {
+            std::stable_sort(postings.begin(), postings.end(), posting_type::less_ngram);
+        }
+    }
+
+    /**
+     * Writes the postings in memory to a temporary file as a sorted run.
+     *  @return bool        \c true if the run is successfully written,
+     *                      \c false otherwise.
+     */
+    bool spill()
+    {
+        std::ofstream ofs;
+        if (!this->open_run(ofs)) {
+            return false;
+        }
+        run_file& file = m_runs.back();
+        file.sections.assign(m_indices.size(), -1);
+
+        std::vector<uint32_t> rank, order;
+        this->rank_ngrams(rank, order);
+
+        postings_type postings;
+        for (size_t i = 0;i < m_indices.size();++i) {
+            partition_type& index = m_indices[i];
+            if (index.values.empty()) {
+                continue;
+            }
+            this->sort_postings(postings, index, rank);
+
+            // Write the section of the size.
+            uint64_t num = 0;
+            for (size_t j = 0;j < postings.size();++j) {
+                if (j == 0 || postings[j].ngram != postings[j-1].ngram) {
+                    ++num;
+                }
+            }
+            file.sections[i] = ofs.tellp();
+            write_value(ofs, (uint32_t)(i+1));
+            write_value(ofs, num);
+
+            const string_type* ngram = NULL;
+            const values_type* values = NULL;
+            postings_source ps(postings, order, m_ngrams);
+            while (ps.next(ngram, values)) {
+                write_group(ofs, *ngram, *values);
+            }
+
+            // Free the memory of the postings.
+            index.spilled += index.values.size();
+            std::vector<uint32_t>().swap(index.ngrams);
+            values_type().swap(index.values);
+        }
+        write_value(ofs, (uint32_t)0);
+        ofs.close();
+
+        if (ofs.fail()) {
+            m_error << "Failed to write a temporary file: " << file.name;
+            return false;
+        }
+
+        // Free the memory of the vocabulary.
+        vocabulary_type().swap(m_vocabulary);
+        std::vector<const string_type*>().swap(m_ngrams);
+        m_usage = 0;
+
+        // Merge the runs so that store() does not open too many files.
+        if (max_runs <= m_runs.size()) {
+            return this->merge_runs();
+        }
+        return true;
+    }
+
+    /**
+     * Merges all the runs into a run.
+     *  @return bool        \c true if the runs are successfully merged,
+     *                      \c false otherwise.
+     */
+    bool merge_runs()
+    {
+        std::vector<run_file> files;
+        files.swap(m_runs);
+
+        std::ofstream ofs;
+        if (!this->open_run(ofs)) {
+            m_runs.insert(m_runs.begin(), files.begin(), files.end());
+            return false;
+        }
+        run_file& file = m_runs.back();
+        file.sections.assign(m_indices.size(), -1);
+
+        bool b = true;
+        for (size_t i = 0;b && i < m_indices.size();++i) {
+            if (m_indices[i].spilled == 0) {
+                continue;
+            }
+
+            // Write the section of the size; the number of n-grams in the
+            // header is fixed after merging them.
+            uint64_t num = 0;
+            file.sections[i] = ofs.tellp();
+            write_value(ofs, (uint32_t)(i+1));
+            write_value(ofs, num);
+
+            const string_type* ngram = NULL;
+            const values_type* values = NULL;
+            merge_source ms(files, (uint32_t)(i+1));
+            while (ms.next(ngram, values)) {
+                write_group(ofs, *ngram, *values);
+                ++num;
+            }
+            if (ms.failed() != NULL) {
+                m_error << "Failed to read a temporary file: " << *ms.failed();
+                b = false;
+            }
+
+            ofs.seekp(file.sections[i] + (std::streamoff)sizeof(uint32_t));
+            write_value(ofs, num);
+            ofs.seekp(0, std::ios::end);
+        }
+        write_value(ofs, (uint32_t)0);
+        ofs.close();
+
+        if (b && ofs.fail()) {
+            m_error << "Failed to write a temporary file: " << file.name;
+            b = false;
+        }
+
+        // Remove the merged runs.
+        for (size_t r = 0;r < files.size();++r) {
+            std::remove(files[r].name.c_str());
+        }
+        return b;
+    }
+
+    /**
+     * Creates a temporary file for a new run.
+     */
+    bool open_run(std::ofstream& ofs)
+    {
+        std::stringstream ss;
+        ss << m_temp << '.' << m_serial++;
+        const std::string name = ss.str();
+
+        ofs.open(name.c_str(), std::ios::binary);
+        if (ofs.fail()) {
+            m_error << "Failed to open a temporary file: " << name;
+            return false;
+        }
+        m_runs.push_back(run_file());
+        m_runs.back().name = name;
+        return true;
+    }
+
+    static void write_group(
+        std::ofstream& ofs,
+        const string_type& ngram,
+        const values_type& values
+        )
+    {
+        write_value(ofs, (uint32_t)ngram.length());
+        ofs.write(
+            reinterpret_cast<const char*>(ngram.c_str()),
+            sizeof(char_type) * ngram.length()
+            );
+        write_value(ofs, (uint32_t)values.size());
+        ofs.write(
+            reinterpret_cast<const char*>(&values[0]),
+            sizeof(value_type) * values.size()
+            );
+    }
+
+    /**
+     * Checks whether the indices are built with the thread pool.
+     */
+    bool parallel() const
+    {
+        return (m_pool != NULL && 1 < m_pool->size());
+    }
+
+    /**
+     * Stores the indices to files with the thread pool.
+     *  Indices with more postings, which are likely to take longer, are
+     *  scheduled first. Sorting the postings of an index in memory needs
+     *  \c sizeof(posting_type) bytes for every posting, for the indices
+     *  processed at a time.
+     *  @param  names       The file names of the indices (indexed by size
+     *                      minus one; empty for sizes without strings).
+     *  @param  rk          The ranks of the n-grams in memory.
+     *  @param  sizes       The array that receives the sizes of the files.
+     */
+    bool store_parallel(
+        const std::vector<std::string>& names,
+        const ranking_type& rk,
+        directory_type& sizes
+        )
+    {
+        std::vector<std::pair<uint64_t, int> > items;
+        for (int i = 0;i < (int)names.size();++i) {
+            if (!names[i].empty()) {
+                const partition_type& index = m_indices[i];
+                uint64_t num = index.ngrams.size() + index.spilled * (i+1);
+                items.push_back(std::make_pair(num, i));
+            }
+        }
+        std::sort(items.rbegin(), items.rend());
+
+        store_job job(*this, names, rk);
+        for (size_t k = 0;k < items.size();++k) {
+            job.sizes.push_back(items[k].second);
+        }
+        m_pool->run(job, (int)job.sizes.size());
+
+        sizes.swap(job.file_sizes);
+        for (size_t i = 0;i < job.errors.size();++i) {
+            if (!job.errors[i].empty()) {
+                m_error << job.errors[i];
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Appends the content of a file to a stream.
+     */
+    bool append_file(std::ofstream& ofs, const std::string& name)
+    {
+        std::ifstream ifs(name.c_str(), std::ios::binary);
+        ofs << ifs.rdbuf();
+        if (ifs.fail() || ofs.fail()) {
+            m_error << "Failed to append a temporary file: " << name;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Prepares for storing the indices.
+     *  The n-grams in memory are ranked; when postings have been spilled,
+     *  the rest is spilled as the last run, from which the indices are
+     *  merged.
+     */
+    bool prepare_store(ranking_type& rk)
+    {
+        if (m_runs.empty()) {
+            this->rank_ngrams(rk.rank, rk.order);
+            return true;
+        }
+        return (m_ngrams.empty() || this->spill());
+    }
+
+    /**
+     * Removes the temporary files of the runs.
+     */
+    void remove_runs()
+    {
+        for (size_t r = 0;r < m_runs.size();++r) {
+            std::remove(m_runs[r].name.c_str());
+        }
+        m_runs.clear();
+        m_serial = 0;
+        for (size_t i = 0;i < m_indices.size();++i) {
+            m_indices[i].spilled = 0;
+        }
+    }
+
+    bool store_index(
+        const std::string& name,
+        int i,
+        const ranking_type& rk,
+        uint64_t& size,
+        std::ostream& es
+        ) const
+    {
+        // Open the database file with binary mode.
+        std::ofstream ofs(name.c_str(), std::ios::binary);
+        if (ofs.fail()) {
+            es << "Failed to open a file for writing: " << name;
+            return false;
+        }
+
+        if (!this->store_index(ofs, name, i, rk, es)) {
+            return false;
+        }
+        size = (uint64_t)(std::streamoff)ofs.tellp();
+        return true;
+    }
+
+    bool store_index(
+        std::ofstream& ofs,
+        const std::string& name,
+        int i,
+        const ranking_type& rk,
+        std::ostream& es
+        ) const
+    {
+        if (m_runs.empty()) {
+            postings_type postings;
+            this->sort_postings(postings, m_indices[i], rk.rank);
+            postings_source ps(postings, rk.order, m_ngrams);
+            return this->write_index(ofs, name, ps, es);
+        }
+
+        merge_source ms(m_runs, (uint32_t)(i+1));
+        if (!this->write_index(ofs, name, ms, es)) {
+            return false;
+        }
+        if (ms.failed() != NULL) {
+            es << "Failed to read a temporary file: " << *ms.failed();
+            return false;
+        }
+        return true;
+    }
+
+    template <class source_type>
+    bool write_index(
+        std::ofstream& ofs,
+        const std::string& name,
+        source_type& src,
+        std::ostream& es
+        ) const
+    {
+        std::vector<uint64_t> fps;
+
+        try {
+            // Open a CDB++ writer.
+            cdbpp::builder dbw(ofs);
+
+            // Put associations: n-gram -> values.
+            const string_type* ngram = NULL;
+            const values_type* values = NULL;
+            std::vector<uint32_t> packed;
+            while (src.next(ngram, values)) {
+                const void* value = &(*values)[0];
+                size_t vsize = sizeof(value_type) * values->size();
+                if (m_flags & FORMAT_COMPRESSED) {
+                    encode_postings(&(*values)[0], values->size(), packed);
+                    value = &packed[0];
+                    vsize = sizeof(packed[0]) * packed.size();
+                } else if (m_flags & FORMAT_SKIP_INDEX) {
+                    encode_skip_postings(&(*values)[0], values->size(), packed);
+                    value = &packed[0];
+                    vsize = sizeof(packed[0]) * packed.size();
+                }
+
+                // Put an association from an n-gram to its values. 
+                if (m_flags & FORMAT_FINGERPRINT) {
+                    uint64_t fp = ngram_fingerprint(*ngram);
+                    fps.push_back(fp);
+                    dbw.put(&fp, sizeof(fp), value, vsize);
+                } else {
+                    dbw.put(
+                        ngram->c_str(),
+                        sizeof(char_type) * ngram->length(),
+                        value,
+                        vsize
+                        );
+                }
             }
 
         } catch (const cdbpp::builder_exception& e) {
-            m_error << "CDB++ error: " << e.what();
+            es << "CDB++ error: " << e.what();
+            return false;
+        }
+
+        // Make sure that the fingerprints identify the n-grams.
+        std::sort(fps.begin(), fps.end());
+        if (std::adjacent_find(fps.begin(), fps.end()) != fps.end()) {
+            es << "Fingerprints of different n-grams collide: " << name;
             return false;
         }
 
         return true;
     }
+
+    template <class T>
+    static void write_value(std::ofstream& ofs, const T& value)
+    {
+        ofs.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void pad(std::ofstream& ofs, uint32_t align)
+    {
+        std::streamoff off = ofs.tellp();
+        while (off % align != 0) {
+            ofs.put(0);
+            ++off;
+        }
+    }
 };
 
 
@@ -342,6 +1467,10 @@ protected:
     std::ofstream m_ofs;
     /// The number of strings in the database.
     int m_num_entries;
+    /// The offsets of the strings (FORMAT_DENSE_ID).
+    std::vector<uint64_t> m_offsets;
+    /// The lengths of the strings (FORMAT_DENSE_ID).
+    std::vector<uint32_t> m_lengths;
 
 public:
     /**
@@ -357,14 +1486,17 @@ public:
      * Constructs a writer object by opening a database.
      *  @param  gen         The n-gram generator used by this writer.
      *  @param  name        The name of the database.
+     *  @param  flags       The options of the database format (a
+     *                      combination of FORMAT_* values).
      */
     writer_base(
         const ngram_generator_type& gen,
-        const std::string& name
+        const std::string& name,
+        int flags = 0
         )
         : base_type(gen), m_num_entries(0)
     {
-        this->open(name);
+        this->open(name, flags);
     }
 
     /**
@@ -378,12 +1510,15 @@ public:
     /**
      * Opens a database.
      *  @param  name        The name of the database.
+     *  @param  flags       The options of the database format (a
+     *                      combination of FORMAT_* values).
      *  @return bool        \c true if the database is successfully opened,
      *                      \c false otherwise.
      */
-    bool open(const std::string& name)
+    bool open(const std::string& name, int flags = 0)
     {
         m_num_entries = 0;
+        this->m_flags = flags;
 
         // Open the master file for writing.
         m_ofs.open(name.c_str(), std::ios::binary);
@@ -398,6 +1533,12 @@ public:
             return false;
         }
 
+        // Create temporary files next to the master file unless specified
+        // otherwise.
+        if (this->m_temp.empty()) {
+            this->m_temp = name + ".tmp";
+        }
+
         m_name = name;
         return true;
     }
@@ -412,9 +1553,35 @@ public:
     {
         bool b = true;
 
-        // Write the n-gram database to files.
+        // Write the n-gram database to files, or append it to the master
+        // file in the single-file format. The master file of the stream
+        // version 3 ends with the directory of the indices, from which the
+        // reader knows the sizes without strings; the region of the table
+        // of strings (FORMAT_DENSE_ID) follows the entries of the indices.
         if (!m_name.empty()) {
-            b &= this->store(m_name);
+            uint64_t table[2] = {0, 0};
+            if (this->m_flags & FORMAT_DENSE_ID) {
+                b &= this->write_table(table);
+            }
+
+            typename base_type::directory_type dir;
+            if (b && (this->m_flags & FORMAT_SINGLE_FILE)) {
+                b = this->store(
+                    m_ofs,
+                    (this->m_flags & FORMAT_HUGE_PAGE_ALIGNMENT) ?
+                        HUGE_PAGE_ALIGNMENT : PARTITION_ALIGNMENT,
+                    dir
+                    );
+            } else if (b) {
+                b = this->store(m_name, dir);
+            }
+
+            if (b && this->m_flags) {
+                if (this->m_flags & FORMAT_DENSE_ID) {
+                    dir.insert(dir.end(), table, table + 2);
+                }
+                b &= this->write_directory(m_ofs, dir);
+            }
         }
 
         // Finalize the file header, and close the file.
@@ -426,6 +1593,8 @@ public:
         // Initialize the members.
         m_name.clear();
         m_num_entries = 0;
+        m_offsets.clear();
+        m_lengths.clear();
         return b;
     }
 
@@ -437,8 +1606,88 @@ public:
      */
     bool insert(const string_type& str)
     {
-        // This will be the offset address to access the key string.
-        value_type off = (value_type)(std::streamoff)m_ofs.tellp();
+        value_type sid;
+        if (!this->write_string(str, sid)) {
+            return false;
+        }
+
+        // Insert the n-grams of the key string to the database.
+        return base_type::insert(str, sid);
+    }
+
+    /**
+     * Inserts strings to the database.
+     *  The n-grams of the strings are generated with the thread pool if set,
+     *  and each string is then written to the master file together with its
+     *  postings. When an insertion fails, the strings preceding the failed
+     *  one remain inserted as if by insert(const string_type&).
+     *  @param  strs        The strings to be inserted.
+     *  @return bool        \c true if the strings are successfully
+     *                      inserted, \c false otherwise.
+     */
+    bool insert(const std::vector<string_type>& strs)
+    {
+        // Generate the n-grams of all the strings before writing any of
+        // them, so that no string is left in the master file without its
+        // postings.
+        this->generate(strs);
+
+        bool b = true;
+        for (size_t j = 0;j < strs.size();++j) {
+            value_type sid;
+            if (!this->write_string(strs[j], sid)) {
+                return false;
+            }
+            if (!this->append(this->m_batch[j], sid)) {
+                b = false;
+                if (this->fail()) {
+                    break;
+                }
+            }
+        }
+        return b;
+    }
+
+protected:
+    /**
+     * Writes a string to the master file.
+     *  @param  str         The string.
+     *  @param  sid         The SID of the string.
+     */
+    bool write_string(const string_type& str, value_type& sid)
+    {
+        const bool length = (this->m_flags & FORMAT_STRING_LENGTH) != 0;
+
+        // Align the key string with FORMAT_LARGE.
+        if (this->m_flags & FORMAT_LARGE) {
+            std::streamoff pos = m_ofs.tellp() + (length ? sizeof(uint32_t) : 0);
+            for (;pos % LARGE_GRANULARITY != 0;++pos) {
+                m_ofs.put(0);
+            }
+        }
+
+        // Write the length of the key string if necessary.
+        if (length) {
+            write_uint32((uint32_t)str.length());
+        }
+
+        // This will be the offset address to access the key string; the SID
+        // of FORMAT_DENSE_ID is the number of strings inserted so far.
+        uint64_t off = (uint64_t)(std::streamoff)m_ofs.tellp();
+        if (this->m_flags & FORMAT_DENSE_ID) {
+            m_offsets.push_back(off);
+            m_lengths.push_back((uint32_t)str.length());
+            off = (uint64_t)m_num_entries;
+        } else if (this->m_flags & FORMAT_LARGE) {
+            off /= LARGE_GRANULARITY;
+        }
+        if (0xFFFFFFFFULL < off) {
+            this->m_error << "The master file is too large for SIDs";
+            if (!(this->m_flags & FORMAT_LARGE)) {
+                this->m_error << " (use FORMAT_LARGE)";
+            }
+            return false;
+        }
 
         // Write the key string to the master file.
         m_ofs.write(reinterpret_cast<const char*>(str.c_str()), sizeof(char_type) * (str.length()+1));
@@ -448,16 +1697,48 @@ public:
         }
         ++m_num_entries;
 
-        // Insert the n-grams of the key string to the database.
-        return base_type::insert(str, off);
+        sid = (value_type)off;
+        return true;
+    }
+
+    /**
+     * Writes the table of strings (FORMAT_DENSE_ID) to the master file.
+     *  The table consists of the offsets (64-bit integers) of the strings
+     *  followed by their lengths (32-bit integers).
+     *  @param  region      The array that receives the offset and size of
+     *                      the table.
+     */
+    bool write_table(uint64_t region[2])
+    {
+        base_type::pad(m_ofs, sizeof(uint64_t));
+        region[0] = (uint64_t)(std::streamoff)m_ofs.tellp();
+        if (!m_offsets.empty()) {
+            m_ofs.write(
+                reinterpret_cast<const char*>(&m_offsets[0]),
+                sizeof(m_offsets[0]) * m_offsets.size()
+                );
+            m_ofs.write(
+                reinterpret_cast<const char*>(&m_lengths[0]),
+                sizeof(m_lengths[0]) * m_lengths.size()
+                );
+        }
+        if (m_ofs.fail()) {
+            this->m_error << "Failed to write the table of strings.";
+            return false;
+        }
+        region[1] = (uint64_t)(std::streamoff)m_ofs.tellp() - region[0];
+        return true;
     }
 
-protected:
     bool write_header(std::ofstream& ofs)
     {
         uint32_t num_entries = m_num_entries;
         uint32_t max_size = (uint32_t)this->max_size();
-        uint32_t size = (uint32_t)m_ofs.tellp();
+        uint64_t size = (uint64_t)(std::streamoff)m_ofs.tellp();
+        if (0xFFFFFFFFULL < size && !(this->m_flags & FORMAT_LARGE)) {
+            this->m_error << "The database file exceeds 4 GB (use FORMAT_LARGE)";
+            return false;
+        }
 
         // Seek to the beginning of the master file, to which the file header
         // is to be written.
@@ -467,16 +1748,23 @@ protected:
             return false;
         }
 
-        // Write the file header.
+        // Write the file header; a database without format options is
+        // written in the stream version 2 so that SimString 1.0 reads it.
         m_ofs.write("SSDB", 4);
         write_uint32(BYTEORDER_CHECK);
-        write_uint32(SIMSTRING_STREAM_VERSION);
-        write_uint32(size);
+        write_uint32(this->m_flags ? SIMSTRING_STREAM_VERSION : 2);
+        write_uint32((uint32_t)std::min(size, (uint64_t)0xFFFFFFFFULL));
         write_uint32(sizeof(char_type));
         write_uint32(this->m_gen.get_n());
         write_uint32(static_cast<int>(this->m_gen.get_be()));
         write_uint32(num_entries);
         write_uint32(max_size);
+        if (this->m_flags) {
+            write_uint32((uint32_t)this->m_flags);
+        }
+        if (this->m_flags & FORMAT_LARGE) {
+            m_ofs.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        }
         if (ofs.fail()) {
             this->m_error << "Failed to write a file header to the master file.";
             return false;
@@ -511,8 +1799,14 @@ protected:
     // An inverted list of SIDs.
     struct inverted_list_type
     {
+        // The number of SIDs.
         int num;
+        // The array of SIDs (NULL if the list is block-packed).
         const value_type* values;
+        // The block-packed list (NULL if values is available).
+        const void* packed;
+        // The first SIDs of the blocks of values (NULL if no skip index).
+        const uint32_t* skips;
 
         friend bool operator<(
             const inverted_list_type& x, 
@@ -525,6 +1819,21 @@ protected:
     // An array of inverted lists.
     typedef std::vector<inverted_list_type> inverted_lists_type;
 
+    // A query n-gram prepared for looking up the indices.
+    struct lookup_key_type
+    {
+        // The pointer to the key.
+        const void* key;
+        // The size of the key.
+        size_t ksize;
+        // The hash value of the key, shared by the indices of all sizes.
+        uint32_t hash;
+        // The fingerprint of the n-gram (FORMAT_FINGERPRINT).
+        uint64_t fingerprint;
+    };
+    // An array of query n-grams prepared for lookups.
+    typedef std::vector<lookup_key_type> lookup_keys_type;
+
     // A hash table that retrieves SIDs from n-grams.
     typedef cdbpp::cdbpp hashtbl_type;
 
@@ -535,6 +1844,13 @@ protected:
         memory_mapped_file  image;
         // The index.
         hashtbl_type        table;
+        // The region of the index in the master file (FORMAT_SINGLE_FILE).
+        size_t              offset;
+        size_t              length;
+
+        index_type() : offset(0), length(0)
+        {
+        }
     };
 
     // Indices with different sizes of strings.
@@ -557,25 +1873,160 @@ protected:
     // An array of candidates.
     typedef std::vector<candidate_type> candidates_type;
 
-    // An array of SIDs retrieved.
-    typedef std::vector<value_type> results_type;
+    // A read position in a posting list.
+    struct cursor_type
+    {
+        const value_type* cur;
+        const value_type* last;
 
-protected:
-    // The array of the indices.
-    indices_type m_indices;
-    // The maximum size of strings in the database.
-    int m_max_size;
-    // The database name (base name of indices).
-    std::string m_name;
-    // The error message.
-    std::stringstream m_error;
+        cursor_type(const value_type* c, const value_type* l)
+            : cur(c), last(l)
+        {
+        }
+
+        // Orders cursors so that std::make_heap() builds a min-heap.
+        friend bool operator<(const cursor_type& x, const cursor_type& y)
+        {
+            return (*y.cur < *x.cur);
+        }
+    };
+
+    // A SID retrieved.
+    struct result_type
+    {
+        // The SID.
+        value_type  value;
+        // The overlap count between the query and the string.
+        int         num;
+        // The number of n-grams of the string.
+        int         size;
+
+        result_type(value_type v, int n, int s)
+            : value(v), num(n), size(s)
+        {
+        }
+    };
 
+    // An array of SIDs retrieved.
+    typedef std::vector<result_type> results_type;
 
 public:
     /**
-     * Constructs an object.
+     * Modes of an overlap join.
+     */
+    enum {
+        /// Retrieves the SIDs that satisfy the join.
+        join_retrieve = 0,
+        /// Tests whether a SID satisfies the join.
+        join_check = 1,
+        /// Retrieves the SIDs with their exact overlap counts.
+        join_count = 2,
+    };
+
+    /**
+     * Scratch buffers used by an overlap join.
+     *  An opened database is never modified by retrieval, so that a single
+     *  object can serve several threads at the same time as long as each
+     *  thread uses a workspace of its own. The buffers keep their memory
+     *  after a join; once they have grown for the queries at hand, joins
+     *  in the calling thread no longer allocate memory.
+     */
+    struct join_workspace_type
+    {
+        // The postings corresponding to the query n-grams.
+        inverted_lists_type posts;
+        // The active candidates.
+        candidates_type     cands;
+        // The candidates for the next step.
+        candidates_type     tmp;
+        // The heap for merging postings.
+        std::vector<cursor_type> heap;
+        // The counters for merging postings.
+        std::vector<uint16_t> counters;
+        // The SIDs decoded from block-packed postings.
+        std::vector<value_type> decoded;
+    };
+
+    struct workspace_type : public join_workspace_type
+    {
+        // The query n-grams prepared for lookups.
+        lookup_keys_type    keys;
+        // The SIDs retrieved.
+        results_type        results;
+        // The SIDs retrieved for a string size (top-k retrieval).
+        results_type        found;
+        // The string sizes with their upper bounds of similarity (top-k
+        // retrieval).
+        std::vector<std::pair<double, int> > bounds;
+        // The heap of the best SIDs (top-k retrieval).
+        std::vector<std::pair<double, result_type> > best;
+        // The thread pool for running joins of different string sizes in
+        // parallel (NULL to run them in the calling thread). Workspaces of
+        // different threads may share a pool, which runs their joins one
+        // query at a time.
+        thread_pool*        pool;
+        // The workspaces of the workers of the pool.
+        std::vector<join_workspace_type> workers;
+        // The string sizes joined by the pool, in the order of execution.
+        std::vector<int>    sizes;
+        // The SIDs retrieved by the pool for each string size.
+        std::vector<results_type> partitions;
+
+        workspace_type() : pool(NULL)
+        {
+        }
+    };
+
+    /**
+     * Scratch buffers used by an overlap join for a batch of queries.
+     *  @param  ngram_tmpl  The type of an n-gram of the queries.
+     */
+    template <class ngram_tmpl>
+    struct batch_workspace_type : public workspace_type
+    {
+        // The n-grams of the batch with their positions.
+        std::vector<std::pair<const ngram_tmpl*, int> > entries;
+        // The distinct n-grams of the batch.
+        std::vector<const ngram_tmpl*> uniques;
+        // The numbers of the distinct n-grams at the positions.
+        std::vector<int>    ids;
+        // The positions of the first n-grams of the queries.
+        std::vector<int>    offsets;
+        // The ranges of string sizes of the queries.
+        std::vector<int>    xmins;
+        std::vector<int>    xmaxs;
+        // The posting lists of the distinct n-grams for a string size.
+        inverted_lists_type lists;
+        // The string sizes for which the posting lists were looked up.
+        std::vector<int>    resolved;
+    };
+
+protected:
+    // The array of the indices.
+    indices_type m_indices;
+    // The memory image of the master file, which also contains the
+    // indices in the single-file format.
+    memory_mapped_file m_image;
+    // The maximum size of strings in the database.
+    int m_max_size;
+    // The options of the database format.
+    int m_flags;
+    // The options of opening the database.
+    int m_options;
+    // The database name (base name of indices).
+    std::string m_name;
+    // The seconds spent for warming up the database.
+    double m_warmup_time;
+    // The error message.
+    std::stringstream m_error;
+
+
+public:
+    /**
+     * Constructs an object.
      */
     ngramdb_reader_base()
+        : m_max_size(0), m_flags(0), m_options(0), m_warmup_time(0.)
     {
     }
 
@@ -606,15 +2057,59 @@ public:
 
     /**
      * Opens an n-gram database.
+     *  This function opens the indices of all string sizes in advance so
+     *  that retrieval never modifies the object. A database in the
+     *  single-file format is mapped to memory at once (unless the caller
+     *  has mapped the master file), and the indices are located by the
+     *  directory at the end of the file.
      *  @param  name        The name of the database.
      *  @param  max_size    The maximum size of the strings.
+     *  @param  flags       The options of the database format.
+     *  @param  dir         The directory of the indices stored in the
+     *                      master file, which tells the sizes without
+     *                      strings; if this is \c NULL, this function
+     *                      tries to open the index files of all sizes.
+     *  @param  options     The options of opening the database; only
+     *                      OPEN_HUGE_PAGES is used by this function.
+     *  @return bool        \c true if the database is successfully opened,
+     *                      \c false otherwise.
      */
-    void open(const std::string& name, int max_size)
+    bool open(
+        const std::string& name,
+        int max_size,
+        int flags = 0,
+        const char* dir = NULL,
+        int options = 0
+        )
     {
         m_name = name;
         m_max_size = max_size;
+        m_flags = flags;
+        m_options = options;
         // The maximum size corresponds to the number of indices in the database.
         m_indices.resize(max_size);
+        if (flags & FORMAT_SINGLE_FILE) {
+            return open_partitions(name, dir);
+        }
+        for (int size = 1;size <= max_size;++size) {
+            if (dir == NULL) {
+                open_index(m_name, size);
+                continue;
+            }
+
+            // Skip a size without strings, and make sure that the index
+            // file is the one written with the master file.
+            uint64_t length = read_uint64(dir + 16 * (size-1) + 8);
+            if (length != 0) {
+                const index_type& index = m_indices[size-1];
+                open_index(m_name, size);
+                if (!index.table.is_open() || index.image.size() != length) {
+                    m_error << "Missing or inconsistent index file of size " << size;
+                    return false;
+                }
+            }
+        }
+        return true;
     }
 
     /**
@@ -624,24 +2119,112 @@ public:
     {
         m_name.clear();
         m_indices.clear();
+        m_image.close();
+        m_flags = 0;
+        m_options = 0;
+        m_warmup_time = 0.;
         m_error.str("");
     }
 
+    /**
+     * Warms up the indices of the specific sizes.
+     *  Warming up the indices of all sizes also warms up the master file.
+     *  @param  options     The options (a combination of OPEN_POPULATE,
+     *                      OPEN_LOCK, and OPEN_RANDOM) applied to the
+     *                      indices.
+     *  @param  min_size    The minimum size of strings.
+     *  @param  max_size    The maximum size of strings; zero stands for
+     *                      the maximum size of strings in the database.
+     *  @return bool        \c true if the options are successfully applied,
+     *                      \c false otherwise.
+     */
+    bool warm(int options, int min_size = 1, int max_size = 0)
+    {
+        std::chrono::steady_clock::time_point clk = std::chrono::steady_clock::now();
+        if (max_size <= 0 || m_max_size < max_size) {
+            max_size = m_max_size;
+        }
+        min_size = std::max(min_size, 1);
+
+        // The image of the master file contains the indices of a database in
+        // the single-file format.
+        bool b = true;
+        const bool all = (min_size == 1 && max_size == m_max_size);
+        if (all && m_image.is_open()) {
+            b &= warm(m_image, options, 0, m_image.size());
+        }
+        for (int size = min_size;size <= max_size;++size) {
+            index_type& index = m_indices[size-1];
+            if (index.image.is_open()) {
+                b &= warm(index.image, options, 0, index.image.size());
+            } else if (index.length != 0 && !all) {
+                b &= warm(m_image, options, index.offset, index.length);
+            }
+        }
+
+        m_warmup_time += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - clk).count();
+        return b;
+    }
+
+    /**
+     * Returns the seconds spent for warming up the database.
+     *  @return double      The total seconds of warm() calls, including the
+     *                      warm-up in opening the database.
+     */
+    double warmup_time() const
+    {
+        return m_warmup_time;
+    }
+
+    /**
+     * Returns the options of the database format.
+     *  @return int         The options (a combination of FORMAT_* values).
+     */
+    int flags() const
+    {
+        return m_flags;
+    }
+
+    /**
+     * Performs an overlap join on inverted lists retrieved for the query.
+     *  @param  query       The query object that stores query n-grams,
+     *                      threshold, and conditions for the similarity
+     *                      measure.
+     *  @param  results     The SIDs that satisfies the overlap join.
+     *  @param  mode        The mode of the join (join_retrieve, join_check,
+     *                      or join_count).
+     */
+    template <class measure_type, class query_type>
+    bool overlapjoin(const query_type& query, double alpha, results_type& results, int mode) const
+    {
+        workspace_type ws;
+        return overlapjoin<measure_type>(query, alpha, ws, results, mode);
+    }
+
     /**
      * Performs an overlap join on inverted lists retrieved for the query.
      *  @param  query       The query object that stores query n-grams,
      *                      threshold, and conditions for the similarity
      *                      measure.
+     *  @param  ws          The workspace of the calling thread.
      *  @param  results     The SIDs that satisfies the overlap join.
+     *  @param  mode        The mode of the join (join_retrieve, join_check,
+     *                      or join_count).
      */
     template <class measure_type, class query_type>
-    bool overlapjoin(const query_type& query, double alpha, results_type& results, bool check)
+    bool overlapjoin(const query_type& query, double alpha, workspace_type& ws, results_type& results, int mode) const
     {
         int i;
         const int qsize = query.size();
 
-        // Allocate a vector of postings corresponding to n-gram queries.
-        inverted_lists_type posts(qsize);
+        // Prepare a vector of postings corresponding to n-gram queries.
+        inverted_lists_type& posts = ws.posts;
+        posts.resize(qsize);
+
+        // Hash the query n-grams once for all sizes.
+        lookup_keys_type& keys = ws.keys;
+        prepare(query.begin(), query.end(), keys);
 
         // Compute the range of n-gram lengths for the candidate strings;
         // in other words, we do not have to search for strings whose n-gram
@@ -649,10 +2232,16 @@ public:
         const int xmin = std::max(measure_type::min_size(query.size(), alpha), 1);
         const int xmax = std::min(measure_type::max_size(query.size(), alpha), m_max_size);
 
+        // Distribute the joins of different lengths to the thread pool.
+        if (mode != join_check && ws.pool != NULL && 1 < ws.pool->size() && xmin < xmax) {
+            return overlapjoin_parallel<measure_type>(
+                keys, alpha, xmin, xmax, mode, ws, results);
+        }
+
         // Loop for each length in the range.
         for (int xsize = xmin;xsize <= xmax;++xsize) {
             // Access to the n-gram index for the length.
-            hashtbl_type& tbl = open_index(m_name, xsize);
+            const hashtbl_type& tbl = m_indices[xsize-1].table;
             if (!tbl.is_open()) {
                 // Ignore an empty index.
                 continue;
@@ -661,330 +2250,1729 @@ public:
             // Search for string entries that match to each query n-gram.
             // Note that we do not traverse each entry here, but only obtain
             // the number of and the pointer to the entries.
-            typename query_type::const_iterator it;
-            for (it = query.begin(), i = 0;it != query.end();++it, ++i) {
-                size_t vsize;
-                const void *values = tbl.get(
-                    it->c_str(),
-                    sizeof(it->at(0)) * it->length(),
-                    &vsize
-                    );
-                posts[i].num = (int)(vsize / sizeof(value_type));
-                posts[i].values = reinterpret_cast<const value_type*>(values);
+            for (i = 0;i < qsize;++i) {
+                posts[i] = lookup(tbl, keys[i]);
             }
 
-            // Sort the query n-grams by ascending order of their frequencies.
-            // This reduces the number of initial candidates.
-            std::sort(posts.begin(), posts.end());
-
             // The minimum number of n-gram matches required for the query.
             const int mmin = measure_type::min_match(qsize, xsize, alpha);
-            // A candidate must match to one of n-grams in these queries.
-            const int min_queries = qsize - mmin + 1;
-
-            // Step 1: collect candidates that match to the initial queries.
-            candidates_type cands;
-            for (i = 0;i < min_queries;++i) {
-                candidates_type tmp;
-                typename candidates_type::const_iterator itc = cands.begin();
-                const value_type* p = posts[i].values;
-                const value_type* last = posts[i].values + posts[i].num;
-
-                while (itc != cands.end() || p != last) {
-                    if (itc == cands.end() || (p != last && itc->value > *p)) {
-                        tmp.push_back(candidate_type(*p, 1));
-                        ++p;
-                    } else if (p == last || (itc != cands.end() && itc->value < *p)) {
-                        tmp.push_back(candidate_type(itc->value, itc->num));
-                        ++itc;
-                    } else {
-                        tmp.push_back(candidate_type(itc->value, itc->num+1));
-                        ++itc;
-                        ++p;
-                    }
-                }
-                std::swap(cands, tmp);
+
+            if (join(posts, xsize, mmin, ws, results, mode) && mode == join_check) {
+                return true;
             }
+        }
 
-            // No initial candidate is found.
-            if (cands.empty()) {
-                continue;
+        return !results.empty();
+    }
+
+    /**
+     * Performs overlap joins for a batch of queries.
+     *  This function is equivalent to calling overlapjoin() for every query,
+     *  but the posting list of an n-gram shared by several queries is looked
+     *  up only once for each string size.
+     *  @param  queries     The array of query objects (n-grams).
+     *  @param  alpha       The threshold.
+     *  @param  ws          The workspace of the calling thread.
+     *  @param  results     The array that receives the SIDs retrieved for
+     *                      every query.
+     */
+    template <class measure_type, class query_type>
+    void overlapjoin_batch(
+        const std::vector<query_type>& queries,
+        double alpha,
+        batch_workspace_type<typename query_type::value_type>& ws,
+        std::vector<results_type>& results
+        ) const
+    {
+        typedef typename query_type::value_type ngram_type;
+        typedef std::pair<const ngram_type*, int> entry_type;
+
+        const int n = (int)queries.size();
+        results.resize(n);
+
+        // Enumerate all n-grams in the batch, and sort them so that the same
+        // n-grams are adjacent.
+        std::vector<entry_type>& entries = ws.entries;
+        std::vector<int>& offsets = ws.offsets;
+        entries.clear();
+        offsets.assign(n+1, 0);
+        for (int q = 0;q < n;++q) {
+            offsets[q+1] = offsets[q] + (int)queries[q].size();
+            typename query_type::const_iterator it;
+            for (it = queries[q].begin();it != queries[q].end();++it) {
+                entries.push_back(entry_type(&*it, (int)entries.size()));
+            }
+        }
+        std::sort(entries.begin(), entries.end(), less_entry<ngram_type>());
+
+        // Assign a unique number to every distinct n-gram.
+        std::vector<int>& ids = ws.ids;
+        std::vector<const ngram_type*>& uniques = ws.uniques;
+        ids.resize(entries.size());
+        uniques.clear();
+        for (size_t j = 0;j < entries.size();++j) {
+            if (j == 0 || *entries[j-1].first != *entries[j].first) {
+                uniques.push_back(entries[j].first);
+            }
+            ids[entries[j].second] = (int)uniques.size() - 1;
+        }
+
+        // Compute the range of sizes for each query.
+        int gmin = INT_MAX, gmax = 0;
+        std::vector<int>& xmins = ws.xmins;
+        std::vector<int>& xmaxs = ws.xmaxs;
+        xmins.resize(n);
+        xmaxs.resize(n);
+        for (int q = 0;q < n;++q) {
+            results[q].clear();
+            const int qsize = (int)queries[q].size();
+            xmins[q] = std::max(measure_type::min_size(qsize, alpha), 1);
+            xmaxs[q] = std::min(measure_type::max_size(qsize, alpha), m_max_size);
+            if (xmins[q] <= xmaxs[q]) {
+                gmin = std::min(gmin, xmins[q]);
+                gmax = std::max(gmax, xmaxs[q]);
             }
+        }
 
-            // Step 2: count the number of matches with remaining queries.
-            for (;i < qsize;++i) {
-                candidates_type tmp;
-                typename candidates_type::const_iterator itc;
-                const value_type* first = posts[i].values;
-                const value_type* last = posts[i].values + posts[i].num;
+        // Hash the distinct n-grams once for all sizes.
+        lookup_keys_type& keys = ws.keys;
+        keys.resize(uniques.size());
+        for (size_t j = 0;j < uniques.size();++j) {
+            prepare(*uniques[j], keys[j]);
+        }
 
-                // For each active candidate.
-                for (itc = cands.begin();itc != cands.end();++itc) {
-                    int num = itc->num;
-                    if (std::binary_search(first, last, itc->value)) {
-                        ++num;
-                    }
+        // The posting lists of the distinct n-grams for the current size,
+        // which are looked up on demand.
+        inverted_lists_type& lists = ws.lists;
+        std::vector<int>& resolved = ws.resolved;
+        lists.resize(uniques.size());
+        resolved.assign(uniques.size(), 0);
 
-                    if (mmin <= num) {
-                        // This candidate has sufficient matches.
-                        if (check) {
-                            return true;
-                        }
-                        results.push_back(itc->value);
-                    } else if (num + (qsize - i - 1) >= mmin) {
-                        // This candidate still has the chance.
-                        tmp.push_back(candidate_type(itc->value, num));
+        for (int xsize = gmin;xsize <= gmax;++xsize) {
+            const hashtbl_type& tbl = m_indices[xsize-1].table;
+            if (!tbl.is_open()) {
+                continue;
+            }
+
+            for (int q = 0;q < n;++q) {
+                if (xsize < xmins[q] || xmaxs[q] < xsize) {
+                    continue;
+                }
+
+                // Obtain the postings for the query n-grams.
+                const int qsize = offsets[q+1] - offsets[q];
+                inverted_lists_type& posts = ws.posts;
+                posts.resize(qsize);
+                for (int i = 0;i < qsize;++i) {
+                    const int id = ids[offsets[q] + i];
+                    if (resolved[id] != xsize) {
+                        lists[id] = lookup(tbl, keys[id]);
+                        resolved[id] = xsize;
                     }
+                    posts[i] = lists[id];
                 }
-                std::swap(cands, tmp);
 
-                // Exit the loop if all candidates are pruned.
-                if (cands.empty()) {
+                const int mmin = measure_type::min_match(qsize, xsize, alpha);
+                join(posts, xsize, mmin, ws, results[q], join_retrieve);
+            }
+        }
+    }
+
+    /**
+     * Performs an overlap join that finds the k most similar strings.
+     *  String sizes are visited in the descending order of the largest
+     *  similarity that a string of the size can achieve. Once k strings are
+     *  found, the similarity of the k-th string is used as the threshold,
+     *  which raises the minimum overlap count for the remaining sizes and
+     *  terminates the search when no remaining size can beat the k-th.
+     *  Strings of the same similarity are ranked by the ascending order of
+     *  SIDs, so that the result does not depend on the order of the sizes.
+     *  @param  query       The query object that stores query n-grams.
+     *  @param  k           The number of strings to be retrieved.
+     *  @param  alpha       The lower bound of the similarity.
+     *  @param  ws          The workspace of the calling thread.
+     *  @param  results     The SIDs retrieved, in the descending order of
+     *                      similarity.
+     */
+    template <class measure_type, class query_type>
+    void overlapjoin_topk(
+        const query_type& query,
+        int k,
+        double alpha,
+        workspace_type& ws,
+        results_type& results
+        ) const
+    {
+        typedef std::pair<double, int> size_bound_type;
+        typedef std::pair<double, result_type> scored_result_type;
+
+        int i;
+        const int qsize = (int)query.size();
+        results.clear();
+        if (k <= 0 || qsize == 0) {
+            return;
+        }
+
+        // Compute the largest similarity achievable by each size.
+        std::vector<size_bound_type>& sizes = ws.bounds;
+        sizes.clear();
+        for (int xsize = 1;xsize <= m_max_size;++xsize) {
+            if (m_indices[xsize-1].table.is_open()) {
+                double bound = measure_type::score(qsize, xsize, std::min(qsize, xsize));
+                if (0. < bound && alpha <= bound) {
+                    sizes.push_back(size_bound_type(-bound, xsize));
+                }
+            }
+        }
+        std::sort(sizes.begin(), sizes.end());
+
+        // A min-heap of the k best strings found so far.
+        std::vector<scored_result_type>& heap = ws.best;
+        results_type& tmp = ws.found;
+        heap.clear();
+        inverted_lists_type& posts = ws.posts;
+        posts.resize(qsize);
+        lookup_keys_type& keys = ws.keys;
+        prepare(query.begin(), query.end(), keys);
+
+        for (size_t j = 0;j < sizes.size();++j) {
+            const double bound = -sizes[j].first;
+            const int xsize = sizes[j].second;
+
+            // The current threshold.
+            double threshold = alpha;
+            if ((int)heap.size() == k) {
+                threshold = std::max(threshold, heap.front().first);
+                if (bound < threshold) {
+                    // No string in the remaining sizes can enter the top k;
+                    // a size whose bound ties with the k-th is still joined
+                    // since its strings may have smaller SIDs.
                     break;
                 }
             }
 
-            if (!cands.empty()) {
-                // Step 2 was not performed.
-                typename candidates_type::const_iterator itc;
-                for (itc = cands.begin();itc != cands.end();++itc) {
-                    if (mmin <= itc->num) {
-                        if (check) {
-                            return true;
-                        }
-                        results.push_back(itc->value);
-                    }
+            const hashtbl_type& tbl = m_indices[xsize-1].table;
+            for (i = 0;i < qsize;++i) {
+                posts[i] = lookup(tbl, keys[i]);
+            }
+
+            // The rounding of min_match() may exclude a string tying with
+            // the k-th; lower the count while its score reaches the threshold.
+            int mmin = std::max(measure_type::min_match(qsize, xsize, threshold), 1);
+            while (alpha < threshold && 1 < mmin &&
+                threshold <= measure_type::score(qsize, xsize, mmin-1)) {
+                --mmin;
+            }
+            if (std::min(qsize, xsize) < mmin) {
+                continue;
+            }
+
+            tmp.clear();
+            join(posts, xsize, mmin, ws, tmp, join_count);
+
+            // Update the top k strings.
+            typename results_type::const_iterator itr;
+            for (itr = tmp.begin();itr != tmp.end();++itr) {
+                double score = measure_type::score(qsize, xsize, itr->num);
+                if (score < alpha) {
+                    continue;
+                }
+                const scored_result_type cand(score, *itr);
+                if ((int)heap.size() < k) {
+                    heap.push_back(cand);
+                    std::push_heap(heap.begin(), heap.end(), greater_score());
+                } else if (greater_score()(cand, heap.front())) {
+                    std::pop_heap(heap.begin(), heap.end(), greater_score());
+                    heap.back() = cand;
+                    std::push_heap(heap.begin(), heap.end(), greater_score());
                 }
             }
         }
 
-        return !results.empty();
+        // Output the strings in the descending order of similarity.
+        std::sort_heap(heap.begin(), heap.end(), greater_score());
+        for (size_t j = 0;j < heap.size();++j) {
+            results.push_back(heap[j].second);
+        }
     }
 
 protected:
-    /**
-     * Open the index storing strings of the specific size.
-     *  @param  base            The base name of the indices.
-     *  @param  size            The size of strings.
-     *  @return hashtbl_type&   The hash table of the index.
-     */
-    hashtbl_type& open_index(const std::string& base, int size)
+    // Orders scored SIDs by the descending order of similarity, and then by
+    // the ascending order of SIDs.
+    struct greater_score
     {
-        index_type& index = m_indices[size-1];
-        if (!index.table.is_open()) {
-            std::stringstream ss;
-            ss << base << '.' << size << ".cdb";
-            index.image.open(ss.str().c_str(), std::ios::in);
-            if (index.image.is_open()) {
-                index.table.open(index.image.data(), index.image.size());
+        bool operator()(
+            const std::pair<double, result_type>& x,
+            const std::pair<double, result_type>& y
+            ) const
+        {
+            if (x.first != y.first) {
+                return (y.first < x.first);
             }
+            return (x.second.value < y.second.value);
         }
+    };
 
-        return index.table;
-    }
-};
+    // A job that performs the join of a string size on a thread pool.
+    template <class measure_type>
+    class partition_job : public thread_pool::job
+    {
+    public:
+        const ngramdb_reader_base& db;
+        const lookup_keys_type& keys;
+        double alpha;
+        int xmin;
+        int mode;
+        // The string sizes to be processed, in the order of execution.
+        const std::vector<int>& sizes;
+        // The workspaces of workers.
+        std::vector<join_workspace_type>& workspaces;
+        // The SIDs retrieved for each size (indexed by xsize - xmin).
+        std::vector<results_type>& results;
+
+        partition_job(
+            const ngramdb_reader_base& db_,
+            const lookup_keys_type& keys_,
+            double alpha_,
+            int xmin_,
+            int mode_,
+            workspace_type& ws
+            )
+            : db(db_), keys(keys_), alpha(alpha_), xmin(xmin_), mode(mode_),
+            sizes(ws.sizes), workspaces(ws.workers), results(ws.partitions)
+        {
+        }
 
+        void run(int index, int worker)
+        {
+            const int xsize = sizes[index];
+            const int qsize = (int)keys.size();
+            const hashtbl_type& tbl = db.m_indices[xsize-1].table;
+            join_workspace_type& ws = workspaces[worker];
+
+            inverted_lists_type& posts = ws.posts;
+            posts.resize(qsize);
+            for (int i = 0;i < qsize;++i) {
+                posts[i] = db.lookup(tbl, keys[i]);
+            }
 
+            const int mmin = measure_type::min_match(qsize, xsize, alpha);
+            db.join(posts, xsize, mmin, ws, results[xsize - xmin], mode);
+        }
+    };
 
-/**
- * A SimString database reader.
- *  This template class retrieves string from a SimString database.
- *
- *  Inheriting the base class ngramdb_reader_base that retrieves string IDs
- *  from a query feature set, this class manages the master string table,
- *  which maintains associations between strings and string IDs.
- */
-class reader
-    : public ngramdb_reader_base<uint32_t>
-{
-public:
-    /// The type of an n-gram generator.
-    typedef ngram_generator ngram_generator_type;
-    /// The type of the base class.
-    typedef ngramdb_reader_base<uint32_t> base_type;
+    // Compares string sizes by the descending order of the index sizes.
+    struct greater_index
+    {
+        const indices_type& indices;
 
-protected:
-    int m_ngram_unit;
-    bool m_be;
-    int m_char_size;
+        greater_index(const indices_type& indices_) : indices(indices_)
+        {
+        }
 
-    /// The content of the master file.
-    std::vector<char> m_strings;
+        bool operator()(int x, int y) const
+        {
+            return (indices[y-1].image.size() < indices[x-1].image.size());
+        }
+    };
 
-public:
     /**
-     * Constructs an object.
+     * Performs an overlap join with the joins of string sizes distributed
+     *  to a thread pool.
+     *  Larger indices, which are likely to take longer, are scheduled
+     *  first; because idle workers claim the remaining sizes, a costly size
+     *  does not hold up the others. The results are merged in the ascending
+     *  order of sizes, which is identical to that of the serial join. The
+     *  scratch buffers of the workers are kept in the workspace of the
+     *  caller, and reused by the subsequent queries.
      */
-    reader()
+    template <class measure_type>
+    bool overlapjoin_parallel(
+        const lookup_keys_type& keys,
+        double alpha,
+        int xmin,
+        int xmax,
+        int mode,
+        workspace_type& ws,
+        results_type& results
+        ) const
     {
+        thread_pool& pool = *ws.pool;
+
+        // Prepare the buffers of the workspace, reusing their memory.
+        ws.sizes.clear();
+        for (int xsize = xmin;xsize <= xmax;++xsize) {
+            if (m_indices[xsize-1].table.is_open()) {
+                ws.sizes.push_back(xsize);
+            }
+        }
+        std::sort(ws.sizes.begin(), ws.sizes.end(), greater_index(m_indices));
+        if (ws.workers.size() < (size_t)pool.size()) {
+            ws.workers.resize(pool.size());
+        }
+        if (ws.partitions.size() < (size_t)(xmax - xmin + 1)) {
+            ws.partitions.resize(xmax - xmin + 1);
+        }
+        for (int i = 0;i <= xmax - xmin;++i) {
+            ws.partitions[i].clear();
+        }
+
+        partition_job<measure_type> job(*this, keys, alpha, xmin, mode, ws);
+        pool.run(job, (int)ws.sizes.size());
+
+        for (int i = 0;i <= xmax - xmin;++i) {
+            results.insert(results.end(), ws.partitions[i].begin(), ws.partitions[i].end());
+        }
+        return !results.empty();
     }
 
+    // Compares n-grams in the batch entries.
+    template <class ngram_type>
+    struct less_entry
+    {
+        bool operator()(
+            const std::pair<const ngram_type*, int>& x,
+            const std::pair<const ngram_type*, int>& y
+            ) const
+        {
+            return (*x.first < *y.first);
+        }
+    };
+
     /**
-     * Destructs an object.
+     * Prepares an n-gram for looking up the indices.
+     *  @param  ngram       The n-gram.
+     *  @param  key         The key that receives the n-gram and its hash
+     *                      value; the key refers to the n-gram, which must
+     *                      outlive the key.
      */
-    virtual ~reader()
+    template <class ngram_type>
+    void prepare(const ngram_type& ngram, lookup_key_type& key) const
     {
-        close();
+        if (m_flags & FORMAT_FINGERPRINT) {
+            key.fingerprint = ngram_fingerprint(ngram);
+            key.key = &key.fingerprint;
+            key.ksize = sizeof(key.fingerprint);
+        } else {
+            key.key = ngram.c_str();
+            key.ksize = sizeof(ngram[0]) * ngram.length();
+        }
+        key.hash = hashtbl_type::hash(key.key, key.ksize);
     }
 
     /**
-     * Opens a SimString database.
-     *  @param  name        The name of the SimString database.
-     *  @return bool        \c true if the database is successfully opened,
-     *                      \c false otherwise.
+     * Prepares the n-grams of a query for looking up the indices.
+     *  @param  first       The iterator to the first n-gram.
+     *  @param  last        The iterator next to the last n-gram.
+     *  @param  keys        The array that receives the keys.
      */
-    bool open(const std::string& name)
+    template <class iterator_type>
+    void prepare(iterator_type first, iterator_type last, lookup_keys_type& keys) const
     {
-        uint32_t num_entries, max_size;
+        keys.resize(std::distance(first, last));
+        for (size_t i = 0;first != last;++first, ++i) {
+            prepare(*first, keys[i]);
+        }
+    }
 
-        // Open the master file.
-        std::ifstream ifs(name.c_str(), std::ios_base::in | std::ios_base::binary);
-        if (ifs.fail()) {
-            this->m_error << "Failed to open the master file: " << name;
-            return false;
+    /**
+     * Looks up the posting list of an n-gram.
+     *  @param  tbl         The index of a string size.
+     *  @param  key         The n-gram prepared by prepare().
+     *  @return inverted_list_type  The posting list.
+     */
+    inverted_list_type lookup(const hashtbl_type& tbl, const lookup_key_type& key) const
+    {
+        size_t vsize;
+        inverted_list_type ret;
+        const void *values = tbl.get(key.key, key.ksize, key.hash, &vsize);
+        ret.num = (int)(vsize / sizeof(value_type));
+        ret.values = reinterpret_cast<const value_type*>(values);
+        ret.packed = NULL;
+        ret.skips = NULL;
+        if ((m_flags & FORMAT_COMPRESSED) && values != NULL) {
+            // The number of SIDs precedes the SIDs or the packed blocks.
+            ret.num = (int)ret.values[0];
+            if (ret.num < posting_min_blocked) {
+                ++ret.values;
+            } else {
+                ret.values = NULL;
+                ret.packed = values;
+            }
+        } else if ((m_flags & FORMAT_SKIP_INDEX) && values != NULL) {
+            // The number of SIDs precedes the SIDs and the skip index.
+            ret.num = (int)ret.values[0];
+            ++ret.values;
+            if (posting_min_skipped <= ret.num) {
+                ret.skips = reinterpret_cast<const uint32_t*>(ret.values + ret.num);
+            }
         }
+        return ret;
+    }
+
+    /**
+     * Performs an overlap join on the postings for a string size.
+     *  @param  posts       The postings corresponding to the query n-grams.
+     *                      This function sorts the postings in place.
+     *  @param  xsize       The size of strings in the postings.
+     *  @param  mmin        The minimum number of n-gram matches.
+     *  @param  ws          The workspace of the calling thread.
+     *  @param  results     The SIDs that satisfies the overlap join.
+     *  @param  mode        The mode of the join.
+     *  @return bool        \c true if a SID is found.
+     */
+    bool join(
+        inverted_lists_type& posts,
+        int xsize,
+        int mmin,
+        join_workspace_type& ws,
+        results_type& results,
+        int mode
+        ) const
+    {
+        int i;
+        const int qsize = (int)posts.size();
+        bool found = false;
 
-        // Obtain the size of the master file.
-        ifs.seekg(0, std::ios_base::end);
-        size_t size = (size_t)ifs.tellg();
-        ifs.seekg(0, std::ios_base::beg);
-        
-        // Read the image of the master file.
-        m_strings.resize(size);
-        ifs.read(&m_strings[0], size);
-        ifs.close();
+        // Sort the query n-grams by ascending order of their frequencies.
+        // This reduces the number of initial candidates.
+        std::sort(posts.begin(), posts.end());
 
-        // Check the file header.
-        const char* p = &m_strings[0];
-        if (size < 36 || std::strncmp(p, "SSDB", 4) != 0) {
-            this->m_error << "Incorrect file format";
-            return false;
-        }
-        p += 4;
+        // A candidate must match to one of n-grams in these queries.
+        const int min_queries = qsize - mmin + 1;
 
-        // Check the byte order.
-        if (BYTEORDER_CHECK != read_uint32(p)) {
-            this->m_error << "Incompatible byte order";
-            return false;
-        }
-        p += 4;
+        // Step 1: collect candidates that match to the initial queries.
+        candidates_type& cands = ws.cands;
+        candidates_type& tmp = ws.tmp;
+        decode(posts, min_queries, ws);
+        merge(posts, min_queries, ws);
+        i = min_queries;
 
-        // Check the version.
-        if (SIMSTRING_STREAM_VERSION != read_uint32(p)) {
-            this->m_error << "Incompatible stream version";
+        // No initial candidate is found.
+        if (cands.empty()) {
             return false;
         }
-        p += 4;
 
-        // Check the chunk size.
-        if (size != read_uint32(p)) {
-            this->m_error << "Inconsistent chunk size";
+        // Step 2: count the number of matches with remaining queries.
+        for (;i < qsize;++i) {
+            tmp.clear();
+            typename candidates_type::const_iterator itc;
+            posting_cursor<value_type> cur(
+                posts[i].values, posts[i].num, posts[i].packed, posts[i].skips,
+                cands.size());
+
+            // For each active candidate.
+            for (itc = cands.begin();itc != cands.end();++itc) {
+                int num = itc->num;
+                if (cur.contains(itc->value)) {
+                    ++num;
+                }
+
+                if (mmin <= num) {
+                    // This candidate has sufficient matches.
+                    if (mode == join_check) {
+                        return true;
+                    } else if (mode == join_count) {
+                        // Count the matches with the remaining queries.
+                        for (int j = i+1;j < qsize;++j) {
+                            if (contains(posts[j], itc->value)) {
+                                ++num;
+                            }
+                        }
+                    }
+                    results.push_back(result_type(itc->value, num, xsize));
+                    found = true;
+                } else if (num + (qsize - i - 1) >= mmin) {
+                    // This candidate still has the chance.
+                    tmp.push_back(candidate_type(itc->value, num));
+                }
+            }
+            std::swap(cands, tmp);
+
+            // Exit the loop if all candidates are pruned.
+            if (cands.empty()) {
+                break;
+            }
+        }
+
+        if (!cands.empty()) {
+            // Step 2 was not performed.
+            typename candidates_type::const_iterator itc;
+            for (itc = cands.begin();itc != cands.end();++itc) {
+                if (mmin <= itc->num) {
+                    if (mode == join_check) {
+                        return true;
+                    }
+                    results.push_back(result_type(itc->value, itc->num, xsize));
+                    found = true;
+                }
+            }
+        }
+
+        return found;
+    }
+
+    /**
+     * Decodes the block-packed lists among the first posting lists.
+     *  @param  posts       The postings.
+     *  @param  k           The number of posting lists to be decoded.
+     *  @param  ws          The workspace that stores the decoded SIDs.
+     */
+    void decode(inverted_lists_type& posts, int k, join_workspace_type& ws) const
+    {
+        size_t total = 0;
+        for (int i = 0;i < k;++i) {
+            if (posts[i].packed) {
+                total += posts[i].num;
+            }
+        }
+        if (total == 0) {
+            return;
+        }
+
+        std::vector<value_type>& decoded = ws.decoded;
+        if (decoded.size() < total) {
+            decoded.resize(total);
+        }
+        value_type* p = &decoded[0];
+        for (int i = 0;i < k;++i) {
+            if (posts[i].packed) {
+                block_list<value_type>(posts[i].packed).decode(p);
+                posts[i].values = p;
+                posts[i].packed = NULL;
+                p += posts[i].num;
+            }
+        }
+    }
+
+    /**
+     * Tests whether a posting list contains a SID.
+     *  @param  post        The posting list.
+     *  @param  value       The SID.
+     *  @return bool        \c true if the list contains the SID.
+     */
+    static bool contains(const inverted_list_type& post, value_type value)
+    {
+        if (post.packed) {
+            return block_list<value_type>(post.packed).contains(value);
+        }
+        if (post.skips) {
+            return skip_list_contains(post.values, post.num, post.skips, value);
+        }
+        return std::binary_search(post.values, post.values + post.num, value);
+    }
+
+    /**
+     * Merges the first posting lists into the candidates with their
+     *  frequencies (stored in ws.cands in the ascending order of SIDs).
+     *  The algorithm is chosen by the number and lengths of the lists: a
+     *  counter array (ScanCount) when the range of SIDs is narrow compared
+     *  with the number of postings, a k-way merge with a heap for three or
+     *  more lists, and a plain merge otherwise.
+     *  @param  posts       The postings.
+     *  @param  k           The number of posting lists to be merged.
+     *  @param  ws          The workspace of the calling thread.
+     */
+    void merge(const inverted_lists_type& posts, int k, join_workspace_type& ws) const
+    {
+        candidates_type& cands = ws.cands;
+        cands.clear();
+
+        // Copy the postings of a single list.
+        if (k == 1) {
+            const value_type* p = posts[0].values;
+            const value_type* last = posts[0].values + posts[0].num;
+            for (;p != last;++p) {
+                cands.push_back(candidate_type(*p, 1));
+            }
+            return;
+        }
+
+        // Compute the number and range of the postings.
+        size_t total = 0;
+        value_type lo = 0, hi = 0;
+        for (int i = 0;i < k;++i) {
+            if (posts[i].num) {
+                const value_type first = posts[i].values[0];
+                const value_type last = posts[i].values[posts[i].num-1];
+                if (total == 0 || first < lo) lo = first;
+                if (total == 0 || hi < last) hi = last;
+                total += posts[i].num;
+            }
+        }
+        if (total == 0) {
+            return;
+        }
+
+        // The cost of pairwise merges is bounded by the sum of the sizes of
+        // intermediate results, whereas a heap merge performs about log2(k)
+        // sift steps per posting, each costing about twice a merge step.
+        size_t prefix = 0, pairwise = 0;
+        for (int i = 0;i < k;++i) {
+            prefix += posts[i].num;
+            pairwise += prefix;
+        }
+        int log2k = 0;
+        while ((1 << log2k) < k) {
+            ++log2k;
+        }
+
+        if (k < 0x10000 && (size_t)(hi - lo) < total * scan_count_density) {
+            merge_scan_count(posts, k, lo, hi, ws);
+        } else if (total * log2k * 2 < pairwise) {
+            merge_heap(posts, k, ws);
+        } else {
+            merge_pairwise(posts, k, ws);
+        }
+    }
+
+    /// The ratio between the range of SIDs and the number of postings
+    /// below which the counter array is used for merging postings.
+    enum { scan_count_density = 4 };
+
+    void merge_scan_count(
+        const inverted_lists_type& posts,
+        int k,
+        value_type lo,
+        value_type hi,
+        join_workspace_type& ws
+        ) const
+    {
+        candidates_type& cands = ws.cands;
+        std::vector<uint16_t>& counters = ws.counters;
+        const size_t range = (size_t)(hi - lo) + 1;
+        if (counters.size() < range) {
+            counters.resize(range, 0);
+        }
+
+        // Count the occurrences of SIDs.
+        for (int i = 0;i < k;++i) {
+            const value_type* p = posts[i].values;
+            const value_type* last = posts[i].values + posts[i].num;
+            for (;p != last;++p) {
+                ++counters[*p - lo];
+            }
+        }
+
+        // Collect the SIDs, clearing the counters for the next use.
+        for (size_t j = 0;j < range;++j) {
+            if (counters[j]) {
+                cands.push_back(candidate_type((value_type)(lo + j), counters[j]));
+                counters[j] = 0;
+            }
+        }
+    }
+
+    void merge_heap(const inverted_lists_type& posts, int k, join_workspace_type& ws) const
+    {
+        candidates_type& cands = ws.cands;
+        std::vector<cursor_type>& heap = ws.heap;
+
+        heap.clear();
+        for (int i = 0;i < k;++i) {
+            if (posts[i].num) {
+                heap.push_back(cursor_type(posts[i].values, posts[i].values + posts[i].num));
+            }
+        }
+        std::make_heap(heap.begin(), heap.end());
+
+        size_t n = heap.size();
+        value_type value = *heap[0].cur;
+        int num = 0;
+        while (n) {
+            // Consume the smallest SID.
+            if (*heap[0].cur != value) {
+                cands.push_back(candidate_type(value, num));
+                value = *heap[0].cur;
+                num = 0;
+            }
+            ++num;
+
+            // Advance the cursor at the top, and restore the heap property.
+            if (++heap[0].cur == heap[0].last) {
+                heap[0] = heap[--n];
+            }
+            size_t j = 0;
+            for (;;) {
+                size_t c = 2 * j + 1;
+                if (n <= c) {
+                    break;
+                }
+                if (c + 1 < n && *heap[c+1].cur < *heap[c].cur) {
+                    ++c;
+                }
+                if (!(*heap[c].cur < *heap[j].cur)) {
+                    break;
+                }
+                std::swap(heap[j], heap[c]);
+                j = c;
+            }
+        }
+        cands.push_back(candidate_type(value, num));
+    }
+
+    void merge_pairwise(const inverted_lists_type& posts, int k, join_workspace_type& ws) const
+    {
+        candidates_type& cands = ws.cands;
+        candidates_type& tmp = ws.tmp;
+
+        for (int i = 0;i < k;++i) {
+            tmp.clear();
+            typename candidates_type::const_iterator itc = cands.begin();
+            const value_type* p = posts[i].values;
+            const value_type* last = posts[i].values + posts[i].num;
+
+            while (itc != cands.end() || p != last) {
+                if (itc == cands.end() || (p != last && itc->value > *p)) {
+                    tmp.push_back(candidate_type(*p, 1));
+                    ++p;
+                } else if (p == last || (itc != cands.end() && itc->value < *p)) {
+                    tmp.push_back(candidate_type(itc->value, itc->num));
+                    ++itc;
+                } else {
+                    tmp.push_back(candidate_type(itc->value, itc->num+1));
+                    ++itc;
+                    ++p;
+                }
+            }
+            std::swap(cands, tmp);
+        }
+    }
+
+    /**
+     * Opens the indices in the memory image of a single-file database.
+     *  @param  name            The name of the database.
+     *  @param  dir             The directory of the indices, or \c NULL
+     *                          to locate it at the end of the file.
+     *  @return bool            \c true if the indices are successfully
+     *                          opened, \c false otherwise.
+     */
+    bool open_partitions(const std::string& name, const char* dir)
+    {
+        if (!m_image.is_open()) {
+            m_image.open(name.c_str(), std::ios::in);
+            if (!m_image.is_open()) {
+                m_error << "Failed to map the database file: " << name;
+                return false;
+            }
+            if (m_options & OPEN_HUGE_PAGES) {
+                m_image.load_huge_pages();
+            }
+        }
+
+        // Locate the directory at the end of the file if necessary; the
+        // indices must precede the directory.
+        const char* image = m_image.const_data();
+        if (dir == NULL) {
+            const uint64_t dsize = 2 * sizeof(uint64_t) * (uint64_t)m_max_size;
+            if ((uint64_t)m_image.size() < dsize) {
+                m_error << "Incorrect directory of the indices";
+                return false;
+            }
+            dir = image + (m_image.size() - dsize);
+        }
+        const uint64_t size = (uint64_t)(dir - image);
+
+        for (int i = 0;i < m_max_size;++i) {
+            uint64_t offset = read_uint64(dir + 16 * i);
+            uint64_t length = read_uint64(dir + 16 * i + 8);
+            if (length == 0) {
+                continue;
+            }
+            if (size < offset || size - offset < length) {
+                m_error << "Incorrect directory of the indices";
+                return false;
+            }
+            m_indices[i].offset = (size_t)offset;
+            m_indices[i].length = (size_t)length;
+            try {
+                m_indices[i].table.open(image + offset, (size_t)length);
+            } catch (const cdbpp::cdbpp_exception& e) {
+                m_error << "CDB++ error: " << e.what();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool warm(memory_mapped_file& image, int options, size_t offset, size_t length)
+    {
+        if (options & OPEN_RANDOM) {
+            image.advise(memory_mapped_file::access_random, offset, length);
+        }
+        if (options & OPEN_POPULATE) {
+            image.populate(offset, length);
+        }
+        if ((options & OPEN_LOCK) && !image.lock(offset, length)) {
+            m_error << "Failed to lock the database in memory";
             return false;
         }
+        return true;
+    }
+
+    static uint64_t read_uint64(const char* p)
+    {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    /**
+     * Open the index storing strings of the specific size.
+     *  @param  base            The base name of the indices.
+     *  @param  size            The size of strings.
+     *  @return hashtbl_type&   The hash table of the index.
+     */
+    hashtbl_type& open_index(const std::string& base, int size)
+    {
+        index_type& index = m_indices[size-1];
+        if (!index.table.is_open()) {
+            std::stringstream ss;
+            ss << base << '.' << size << ".cdb";
+            index.image.open(ss.str().c_str(), std::ios::in);
+            if (index.image.is_open()) {
+                if (m_options & OPEN_HUGE_PAGES) {
+                    index.image.load_huge_pages();
+                }
+                index.table.open(index.image.data(), index.image.size());
+            }
+        }
+
+        return index.table;
+    }
+};
+
+
+
+/**
+ * A string retrieved with its similarity to the query.
+ *  @param  string_tmpl     The type of a string.
+ */
+template <class string_tmpl>
+struct scored_string
+{
+    /// The type representing a string.
+    typedef string_tmpl string_type;
+
+    /// The retrieved string.
+    string_type str;
+    /// The string ID (SID).
+    uint32_t    id;
+    /// The number of n-grams shared by the query and the string.
+    int         num;
+    /// The similarity between the query and the string.
+    double      score;
+
+    scored_string() : id(0), num(0), score(0.)
+    {
+    }
+
+    scored_string(const string_type& s, uint32_t i, int n, double v)
+        : str(s), id(i), num(n), score(v)
+    {
+    }
+
+    /**
+     * Compares strings by the descending order of similarity.
+     */
+    friend bool operator<(const scored_string& x, const scored_string& y)
+    {
+        return (y.score < x.score);
+    }
+};
+
+
+
+/**
+ * A string retrieved as a reference to the memory image of a database.
+ *  The reference is valid until the reader is closed. The string is
+ *  terminated by a null character.
+ *  @param  char_tmpl       The type of a character.
+ */
+template <class char_tmpl>
+struct string_ref
+{
+    /// The type representing a character.
+    typedef char_tmpl char_type;
+
+    /// The pointer to the string.
+    const char_type*    str;
+    /// The length of the string (the number of characters).
+    size_t              length;
+    /// The string ID (SID).
+    uint32_t            id;
+
+    string_ref() : str(NULL), length(0), id(0)
+    {
+    }
+
+    string_ref(const char_type* s, size_t l, uint32_t i)
+        : str(s), length(l), id(i)
+    {
+    }
+};
+
+
+
+/**
+ * A SimString database reader.
+ *  This template class retrieves string from a SimString database.
+ *
+ *  Inheriting the base class ngramdb_reader_base that retrieves string IDs
+ *  from a query feature set, this class manages the master string table,
+ *  which maintains associations between strings and string IDs.
+ *
+ *  An opened reader is immutable: member functions for retrieval are
+ *  \c const and can be called by multiple threads concurrently. A thread
+ *  may pass a context object of its own to retrieval functions so that
+ *  scratch buffers are reused across queries.
+ */
+class reader
+    : public ngramdb_reader_base<uint32_t>
+{
+public:
+    /// The type of an n-gram generator.
+    typedef ngram_generator ngram_generator_type;
+    /// The type of the base class.
+    typedef ngramdb_reader_base<uint32_t> base_type;
+
+    /**
+     * A search context.
+     *  This object holds the scratch state of retrieval. A context must not
+     *  be shared by threads, but one context can be used for any number of
+     *  queries.
+     *  @param  string_tmpl     The type of a query string.
+     */
+    template <class string_tmpl>
+    struct context : public base_type::template batch_workspace_type<string_tmpl>
+    {
+        /// The n-grams of the query.
+        ngram_buffer<string_tmpl> ngrams;
+        /// The order of the strings retrieved with their similarity.
+        std::vector<std::pair<double, int> > order;
+        /// The n-grams of the queries in a batch.
+        std::vector<std::vector<string_tmpl> > batch_ngrams;
+        /// The SIDs retrieved for the queries in a batch.
+        std::vector<typename base_type::results_type> batch_results;
+    };
+
+protected:
+    int m_ngram_unit;
+    bool m_be;
+    int m_char_size;
+
+    /// The content of the master file (mapped to memory).
+    const char* m_master;
+    /// The shift from SIDs to the offsets of strings (FORMAT_LARGE).
+    int m_shift;
+    /// The offsets of strings (FORMAT_DENSE_ID).
+    const uint64_t* m_offsets;
+    /// The lengths of strings (FORMAT_DENSE_ID).
+    const uint32_t* m_lengths;
+
+public:
+    /**
+     * Constructs an object.
+     */
+    reader() : m_master(NULL), m_shift(0), m_offsets(NULL), m_lengths(NULL)
+    {
+    }
+
+    /**
+     * Destructs an object.
+     */
+    virtual ~reader()
+    {
+        close();
+    }
+
+    /**
+     * Opens a SimString database.
+     *  @param  name        The name of the SimString database.
+     *  @param  options     The options of opening the database (a
+     *                      combination of OPEN_* values), which are applied
+     *                      to the master file and the indices of all sizes;
+     *                      the time spent is reported by warmup_time().
+     *  @return bool        \c true if the database is successfully opened,
+     *                      \c false otherwise.
+     */
+    bool open(const std::string& name, int options = 0)
+    {
+        uint32_t num_entries, max_size, flags = 0;
+
+        // Map the master file to memory (read only), so that processes
+        // opening the same database share the pages of the file.
+        this->m_image.open(name.c_str(), std::ios::in);
+        if (!this->m_image.is_open()) {
+            this->m_error << "Failed to open the master file: " << name;
+            return false;
+        }
+        if (options & OPEN_HUGE_PAGES) {
+            this->m_image.load_huge_pages();
+        }
+        const size_t size = this->m_image.size();
+        m_master = this->m_image.const_data();
+
+        // Check the file header.
+        const char* p = m_master;
+        if (size < 36 || std::strncmp(p, "SSDB", 4) != 0) {
+            this->m_error << "Incorrect file format";
+            return false;
+        }
+        p += 4;
+
+        // Check the byte order.
+        if (BYTEORDER_CHECK != read_uint32(p)) {
+            this->m_error << "Incompatible byte order";
+            return false;
+        }
+        p += 4;
+
+        // Check the version; the stream version 3 appends the format
+        // options to the header of the version 2.
+        const uint32_t version = read_uint32(p);
+        if (version != 2 && version != SIMSTRING_STREAM_VERSION) {
+            this->m_error << "Incompatible stream version";
+            return false;
+        }
+        if (version == 3 && size < 40) {
+            this->m_error << "Incorrect file format";
+            return false;
+        }
+        p += 4;
+
+        // Read the chunk size, which is checked after the format options.
+        const uint32_t chunk_size = read_uint32(p);
+        p += 4;
+
+        // Read the unit of n-grams, begin/end flag.
+        m_char_size = (int)read_uint32(p);
+        p += 4;
+        m_ngram_unit = (int)read_uint32(p);
+        p += 4;
+        m_be = (read_uint32(p) != 0);
+        p += 4;
+
+        // Read the number of enties.
+        num_entries = read_uint32(p);
+        p += 4;
+
+        // Read the maximum size of strings in the database.
+        max_size = read_uint32(p);
         p += 4;
 
-        // Read the unit of n-grams, begin/end flag.
-        m_char_size = (int)read_uint32(p);
-        p += 4;
-        m_ngram_unit = (int)read_uint32(p);
-        p += 4;
-        m_be = (read_uint32(p) != 0);
-        p += 4;
+        // Read the options of the database format.
+        if (version == 3) {
+            flags = read_uint32(p);
+            const uint32_t supported =
+                FORMAT_FINGERPRINT | FORMAT_COMPRESSED | FORMAT_SKIP_INDEX |
+                FORMAT_SINGLE_FILE | FORMAT_STRING_LENGTH |
+                FORMAT_HUGE_PAGE_ALIGNMENT | FORMAT_LARGE | FORMAT_DENSE_ID;
+            if (flags & ~supported) {
+                this->m_error << "Unsupported format options: " << flags;
+                return false;
+            }
+            p += 4;
+        }
+
+        // Check the chunk size; FORMAT_LARGE appends the 64-bit size to the
+        // header.
+        if (flags & FORMAT_LARGE) {
+            uint64_t chunk_size64;
+            if (size < 48) {
+                this->m_error << "Incorrect file format";
+                return false;
+            }
+            std::memcpy(&chunk_size64, p, sizeof(chunk_size64));
+            if (size != chunk_size64) {
+                this->m_error << "Inconsistent chunk size";
+                return false;
+            }
+            p += 8;
+            m_shift = 3;
+        } else {
+            if (size != chunk_size) {
+                this->m_error << "Inconsistent chunk size";
+                return false;
+            }
+            m_shift = 0;
+        }
+
+        // The master file of the version 3 ends with the directory of the
+        // indices; the version 2 has none.
+        const char* dir = NULL;
+        const size_t num_regions = max_size + ((flags & FORMAT_DENSE_ID) ? 1 : 0);
+        if (version == 3) {
+            const size_t dsize = 2 * sizeof(uint64_t) * num_regions;
+            if (size < (size_t)(p - m_master) + dsize) {
+                this->m_error << "Incorrect directory of the indices";
+                return false;
+            }
+            dir = m_master + (size - dsize);
+        }
+
+        // Locate the table of strings, which follows the entries of the
+        // indices in the directory.
+        m_offsets = NULL;
+        m_lengths = NULL;
+        if (flags & FORMAT_DENSE_ID) {
+            uint64_t region[2];
+            std::memcpy(region, dir + 2 * sizeof(uint64_t) * max_size, sizeof(region));
+            if (size < region[0] || size - region[0] < region[1] ||
+                region[1] != (uint64_t)num_entries * (sizeof(uint64_t) + sizeof(uint32_t))) {
+                this->m_error << "Incorrect table of strings";
+                return false;
+            }
+            m_offsets = reinterpret_cast<const uint64_t*>(m_master + region[0]);
+            m_lengths = reinterpret_cast<const uint32_t*>(m_offsets + num_entries);
+        }
+        if (!base_type::open(name, (int)max_size, (int)flags, dir, options)) {
+            return false;
+        }
+
+        // Apply the options to the database.
+        return (options == 0 || this->warm(options));
+    }
+
+    /**
+     * Closes the database.
+     */
+    void close()
+    {
+        base_type::close();
+        m_master = NULL;
+        m_offsets = NULL;
+        m_lengths = NULL;
+    }
+
+    int char_size() const
+    {
+        return m_char_size;
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins
+        ) const
+    {
+        context<string_type> ctx;
+        this->retrieve(ctx, query, measure, alpha, ins);
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve(
+        context<string_type>& ctx,
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins
+        ) const
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve<simstring::measure::exact>(ctx, query, alpha, ins);
+            break;
+        case dice:
+            this->retrieve<simstring::measure::dice>(ctx, query, alpha, ins);
+            break;
+        case cosine:
+            this->retrieve<simstring::measure::cosine>(ctx, query, alpha, ins);
+            break;
+        case jaccard:
+            this->retrieve<simstring::measure::jaccard>(ctx, query, alpha, ins);
+            break;
+        case overlap:
+            this->retrieve<simstring::measure::overlap>(ctx, query, alpha, ins);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
+     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
+     *          ::simstring::measure::overlap
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        double alpha,
+        insert_iterator ins
+        ) const
+    {
+        context<string_type> ctx;
+        this->retrieve<measure_type>(ctx, query, alpha, ins);
+    }
 
-        // Read the number of enties.
-        num_entries = read_uint32(p);
-        p += 4;
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve(
+        context<string_type>& ctx,
+        const string_type& query,
+        double alpha,
+        insert_iterator ins
+        ) const
+    {
+        typedef typename string_type::value_type char_type;
 
-        // Read the maximum size of strings in the database.
-        max_size = read_uint32(p);
+        ngram_generator_type gen(m_ngram_unit, m_be);
+        gen(query, ctx.ngrams);
 
-        base_type::open(name, (int)max_size);
-        return true;
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        base_type::overlapjoin<measure_type>(ctx.ngrams, alpha, ctx, results, base_type::join_retrieve);
+
+        typename base_type::results_type::const_iterator it;
+        for (it = results.begin();it != results.end();++it) {
+            const char_type* xstr = this->get_string<char_type>(it->value);
+            *ins = xstr;
+        }
     }
 
     /**
-     * Closes the database.
+     * Retrieves strings that are similar to the query as references.
+     *  Unlike retrieve(), this function does not copy the strings retrieved;
+     *  the references point to the master file mapped to memory. The
+     *  lengths of strings are read from a database of FORMAT_STRING_LENGTH or
+     *  FORMAT_DENSE_ID, and computed from the null terminators otherwise.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as string_ref objects.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
      */
-    void close()
+    template <class string_type, class insert_iterator>
+    void retrieve_refs(
+        context<string_type>& ctx,
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins
+        ) const
     {
-        base_type::close();
+        switch (measure) {
+        case exact:
+            this->retrieve_refs<simstring::measure::exact>(ctx, query, alpha, ins);
+            break;
+        case dice:
+            this->retrieve_refs<simstring::measure::dice>(ctx, query, alpha, ins);
+            break;
+        case cosine:
+            this->retrieve_refs<simstring::measure::cosine>(ctx, query, alpha, ins);
+            break;
+        case jaccard:
+            this->retrieve_refs<simstring::measure::jaccard>(ctx, query, alpha, ins);
+            break;
+        case overlap:
+            this->retrieve_refs<simstring::measure::overlap>(ctx, query, alpha, ins);
+            break;
+        }
     }
 
-    int char_size() const
+    /**
+     * Retrieves strings that are similar to the query as references.
+     *  @param  measure_type    The similarity measure.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as string_ref objects.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_refs(
+        context<string_type>& ctx,
+        const string_type& query,
+        double alpha,
+        insert_iterator ins
+        ) const
     {
-        return m_char_size;
+        typedef typename string_type::value_type char_type;
+
+        ngram_generator_type gen(m_ngram_unit, m_be);
+        gen(query, ctx.ngrams);
+
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        base_type::overlapjoin<measure_type>(ctx.ngrams, alpha, ctx, results, base_type::join_retrieve);
+
+        typename base_type::results_type::const_iterator it;
+        for (it = results.begin();it != results.end();++it) {
+            *ins = this->get_ref<char_type>(it->value);
+        }
     }
 
     /**
-     * Retrieves strings that are similar to the query.
+     * Retrieves strings that are similar to the query with their
+     * similarity scores.
      *  @param  query           The query string.
      *  @param  measure         The similarity measure.
      *  @param  alpha           The threshold for approximate string matching.
      *  @param  ins             The insert iterator that receives retrieved
-     *                          strings.
+     *                          strings as scored_string objects.
+     *  @param  sort            \c true to output strings in descending order
+     *                          of similarity.
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_scored(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins,
+        bool sort = false
+        ) const
+    {
+        context<string_type> ctx;
+        this->retrieve_scored(ctx, query, measure, alpha, ins, sort);
+    }
+
+    /**
+     * Retrieves strings that are similar to the query with their
+     * similarity scores.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as scored_string objects.
+     *  @param  sort            \c true to output strings in descending order
+     *                          of similarity; otherwise strings are output
+     *                          in the same order as retrieve().
      *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
      *          ::simstring::jaccard, ::simstring::overlap
      */
     template <class string_type, class insert_iterator>
-    void retrieve(
+    void retrieve_scored(
+        context<string_type>& ctx,
         const string_type& query,
         int measure,
         double alpha,
-        insert_iterator ins
-        )
+        insert_iterator ins,
+        bool sort = false
+        ) const
     {
         switch (measure) {
         case exact:
-            this->retrieve<simstring::measure::exact>(query, alpha, ins);
+            this->retrieve_scored<simstring::measure::exact>(ctx, query, alpha, ins, sort);
             break;
         case dice:
-            this->retrieve<simstring::measure::dice>(query, alpha, ins);
+            this->retrieve_scored<simstring::measure::dice>(ctx, query, alpha, ins, sort);
             break;
         case cosine:
-            this->retrieve<simstring::measure::cosine>(query, alpha, ins);
+            this->retrieve_scored<simstring::measure::cosine>(ctx, query, alpha, ins, sort);
             break;
         case jaccard:
-            this->retrieve<simstring::measure::jaccard>(query, alpha, ins);
+            this->retrieve_scored<simstring::measure::jaccard>(ctx, query, alpha, ins, sort);
             break;
         case overlap:
-            this->retrieve<simstring::measure::overlap>(query, alpha, ins);
+            this->retrieve_scored<simstring::measure::overlap>(ctx, query, alpha, ins, sort);
             break;
         }
     }
 
     /**
-     * Retrieves strings that are similar to the query.
+     * Retrieves strings that are similar to the query with their
+     * similarity scores.
      *  @param  measure_type    The similarity measure.
+     *  @param  ctx             The search context of the calling thread.
      *  @param  query           The query string.
      *  @param  alpha           The threshold for approximate string matching.
      *  @param  ins             The insert iterator that receives retrieved
-     *                          strings.
-     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
-     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
-     *          ::simstring::measure::overlap
+     *                          strings as scored_string objects.
+     *  @param  sort            \c true to output strings in descending order
+     *                          of similarity.
      */
     template <class measure_type, class string_type, class insert_iterator>
-    void retrieve(
+    void retrieve_scored(
+        context<string_type>& ctx,
         const string_type& query,
         double alpha,
-        insert_iterator ins
-        )
+        insert_iterator ins,
+        bool sort = false
+        ) const
+    {
+        typedef typename string_type::value_type char_type;
+        typedef scored_string<string_type> scored_string_type;
+
+        ngram_generator_type gen(m_ngram_unit, m_be);
+        gen(query, ctx.ngrams);
+        const int qsize = (int)ctx.ngrams.size();
+
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        base_type::overlapjoin<measure_type>(ctx.ngrams, alpha, ctx, results, base_type::join_count);
+
+        // The similarity is computed from the overlap count of the join.
+        // Sorting pairs of the negated similarity and the position keeps
+        // the strings of the same similarity in the order of retrieval.
+        std::vector<std::pair<double, int> >& order = ctx.order;
+        order.clear();
+        for (int i = 0;i < (int)results.size();++i) {
+            const double score = measure_type::score(qsize, results[i].size, results[i].num);
+            order.push_back(std::pair<double, int>(-score, i));
+        }
+        if (sort) {
+            std::sort(order.begin(), order.end());
+        }
+
+        for (size_t i = 0;i < order.size();++i) {
+            const typename base_type::result_type& r = results[order[i].second];
+            const char_type* xstr = this->get_string<char_type>(r.value);
+            *ins = scored_string_type(xstr, r.value, r.num, -order[i].first);
+        }
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as scored_string objects, in the
+     *                          descending order of similarity.
+     *  @param  alpha           The lower bound of the similarity.
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        insert_iterator ins,
+        double alpha = 0.
+        ) const
+    {
+        context<string_type> ctx;
+        this->retrieve_topk(ctx, query, measure, k, ins, alpha);
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as scored_string objects, in the
+     *                          descending order of similarity.
+     *  @param  alpha           The lower bound of the similarity; strings
+     *                          less similar than this are not retrieved even
+     *                          if fewer than k strings are found.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_topk(
+        context<string_type>& ctx,
+        const string_type& query,
+        int measure,
+        int k,
+        insert_iterator ins,
+        double alpha = 0.
+        ) const
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve_topk<simstring::measure::exact>(ctx, query, k, ins, alpha);
+            break;
+        case dice:
+            this->retrieve_topk<simstring::measure::dice>(ctx, query, k, ins, alpha);
+            break;
+        case cosine:
+            this->retrieve_topk<simstring::measure::cosine>(ctx, query, k, ins, alpha);
+            break;
+        case jaccard:
+            this->retrieve_topk<simstring::measure::jaccard>(ctx, query, k, ins, alpha);
+            break;
+        case overlap:
+            this->retrieve_topk<simstring::measure::overlap>(ctx, query, k, ins, alpha);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  query           The query string.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings as scored_string objects, in the
+     *                          descending order of similarity.
+     *  @param  alpha           The lower bound of the similarity.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_topk(
+        context<string_type>& ctx,
+        const string_type& query,
+        int k,
+        insert_iterator ins,
+        double alpha = 0.
+        ) const
     {
-        typedef std::vector<string_type> ngrams_type;
         typedef typename string_type::value_type char_type;
+        typedef scored_string<string_type> scored_string_type;
 
         ngram_generator_type gen(m_ngram_unit, m_be);
-        ngrams_type ngrams;
-        gen(query, std::back_inserter(ngrams));
+        gen(query, ctx.ngrams);
+        const int qsize = (int)ctx.ngrams.size();
 
-        typename base_type::results_type results;
-        base_type::overlapjoin<measure_type>(ngrams, alpha, results, false);
+        typename base_type::results_type& results = ctx.results;
+        base_type::overlapjoin_topk<measure_type>(ctx.ngrams, k, alpha, ctx, results);
 
         typename base_type::results_type::const_iterator it;
-        const char* strings = &m_strings[0];
         for (it = results.begin();it != results.end();++it) {
-            const char_type* xstr = reinterpret_cast<const char_type*>(strings + *it);
-            *ins = xstr;
+            const char_type* xstr = this->get_string<char_type>(it->value);
+            *ins = scored_string_type(
+                xstr, it->value, it->num,
+                measure_type::score(qsize, it->size, it->num)
+                );
+        }
+    }
+
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  @param  queries         The query strings.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  results         The array that receives strings retrieved for
+     *                          every query; \c results[i] corresponds to
+     *                          \c queries[i].
+     */
+    template <class string_type>
+    void retrieve_batch(
+        const std::vector<string_type>& queries,
+        int measure,
+        double alpha,
+        std::vector<std::vector<string_type> >& results
+        ) const
+    {
+        context<string_type> ctx;
+        this->retrieve_batch(ctx, queries, measure, alpha, results);
+    }
+
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  This function is equivalent to calling retrieve() for every query,
+     *  but n-grams shared by the queries are looked up only once for each
+     *  string size.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  queries         The query strings.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  results         The array that receives strings retrieved for
+     *                          every query; \c results[i] corresponds to
+     *                          \c queries[i].
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type>
+    void retrieve_batch(
+        context<string_type>& ctx,
+        const std::vector<string_type>& queries,
+        int measure,
+        double alpha,
+        std::vector<std::vector<string_type> >& results
+        ) const
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve_batch<simstring::measure::exact>(ctx, queries, alpha, results);
+            break;
+        case dice:
+            this->retrieve_batch<simstring::measure::dice>(ctx, queries, alpha, results);
+            break;
+        case cosine:
+            this->retrieve_batch<simstring::measure::cosine>(ctx, queries, alpha, results);
+            break;
+        case jaccard:
+            this->retrieve_batch<simstring::measure::jaccard>(ctx, queries, alpha, results);
+            break;
+        case overlap:
+            this->retrieve_batch<simstring::measure::overlap>(ctx, queries, alpha, results);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  @param  measure_type    The similarity measure.
+     *  @param  ctx             The search context of the calling thread.
+     *  @param  queries         The query strings.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  results         The array that receives strings retrieved for
+     *                          every query.
+     */
+    template <class measure_type, class string_type>
+    void retrieve_batch(
+        context<string_type>& ctx,
+        const std::vector<string_type>& queries,
+        double alpha,
+        std::vector<std::vector<string_type> >& results
+        ) const
+    {
+        typedef std::vector<string_type> ngrams_type;
+        typedef typename string_type::value_type char_type;
+
+        // Generate n-grams for every query.
+        ngram_generator_type gen(m_ngram_unit, m_be);
+        std::vector<ngrams_type>& ngrams = ctx.batch_ngrams;
+        ngrams.resize(queries.size());
+        for (size_t q = 0;q < queries.size();++q) {
+            ngrams[q].clear();
+            gen(queries[q], std::back_inserter(ngrams[q]));
+        }
+
+        std::vector<typename base_type::results_type>& sids = ctx.batch_results;
+        base_type::overlapjoin_batch<measure_type>(ngrams, alpha, ctx, sids);
+
+        // Convert the SIDs into strings.
+        results.resize(queries.size());
+        for (size_t q = 0;q < queries.size();++q) {
+            results[q].clear();
+            typename base_type::results_type::const_iterator it;
+            for (it = sids[q].begin();it != sids[q].end();++it) {
+                const char_type* xstr = this->get_string<char_type>(it->value);
+                results[q].push_back(xstr);
+            }
         }
     }
 
@@ -993,19 +3981,31 @@ public:
         const string_type& query,
         int measure,
         double alpha
-        )
+        ) const
+    {
+        context<string_type> ctx;
+        return this->check(ctx, query, measure, alpha);
+    }
+
+    template <class string_type>
+    bool check(
+        context<string_type>& ctx,
+        const string_type& query,
+        int measure,
+        double alpha
+        ) const
     {
         switch (measure) {
         case exact:
-            return this->check<simstring::measure::exact>(query, alpha);
+            return this->check<simstring::measure::exact>(ctx, query, alpha);
         case dice:
-            return this->check<simstring::measure::dice>(query, alpha);
+            return this->check<simstring::measure::dice>(ctx, query, alpha);
         case cosine:
-            return this->check<simstring::measure::cosine>(query, alpha);
+            return this->check<simstring::measure::cosine>(ctx, query, alpha);
         case jaccard:
-            return this->check<simstring::measure::jaccard>(query, alpha);
+            return this->check<simstring::measure::jaccard>(ctx, query, alpha);
         case overlap:
-            return this->check<simstring::measure::overlap>(query, alpha);
+            return this->check<simstring::measure::overlap>(ctx, query, alpha);
         }
         return false;
     }
@@ -1014,20 +4014,52 @@ public:
     bool check(
         const string_type& query,
         double alpha
-        )
+        ) const
     {
-        typedef std::vector<string_type> ngrams_type;
-        typedef typename string_type::value_type char_type;
+        context<string_type> ctx;
+        return this->check<measure_type>(ctx, query, alpha);
+    }
 
+    template <class measure_type, class string_type>
+    bool check(
+        context<string_type>& ctx,
+        const string_type& query,
+        double alpha
+        ) const
+    {
         ngram_generator_type gen(m_ngram_unit, m_be);
-        ngrams_type ngrams;
-        gen(query, std::back_inserter(ngrams));
+        gen(query, ctx.ngrams);
 
-        typename base_type::results_type results;
-        return base_type::overlapjoin<measure_type>(ngrams, alpha, results, true);
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        return base_type::overlapjoin<measure_type>(ctx.ngrams, alpha, ctx, results, base_type::join_check);
     }
 
 protected:
+    template <class char_type>
+    const char_type* get_string(uint32_t sid) const
+    {
+        if (m_offsets != NULL) {
+            return reinterpret_cast<const char_type*>(m_master + m_offsets[sid]);
+        }
+        return reinterpret_cast<const char_type*>(m_master + ((size_t)sid << m_shift));
+    }
+
+    template <class char_type>
+    string_ref<char_type> get_ref(uint32_t sid) const
+    {
+        const char_type* xstr = this->get_string<char_type>(sid);
+        if (m_lengths != NULL) {
+            return string_ref<char_type>(xstr, m_lengths[sid], sid);
+        } else if (this->m_flags & FORMAT_STRING_LENGTH) {
+            uint32_t length;
+            std::memcpy(&length, reinterpret_cast<const char*>(xstr) - sizeof(length), sizeof(length));
+            return string_ref<char_type>(xstr, length, sid);
+        } else {
+            return string_ref<char_type>(xstr, std::char_traits<char_type>::length(xstr), sid);
+        }
+    }
+
     inline uint32_t read_uint32(const char* p) const
     {
         return *reinterpret_cast<const uint32_t*>(p);
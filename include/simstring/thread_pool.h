@@ -0,0 +1,212 @@
+/*
+ *      A simple thread pool.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_THREAD_POOL_H__
+#define __SIMSTRING_THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace simstring
+{
+
+/**
+ * A pool of worker threads.
+ *  The pool executes a job for indices 0, ..., n-1. Workers claim the next
+ *  unprocessed index one by one, so that a worker that finished cheap items
+ *  takes over the remaining items instead of waiting for others.
+ */
+class thread_pool
+{
+public:
+    /**
+     * A job executed by the pool.
+     */
+    class job
+    {
+    public:
+        virtual ~job()
+        {
+        }
+
+        /**
+         * Processes an item.
+         *  This function must not throw an exception.
+         *  @param  index       The index of the item.
+         *  @param  worker      The number of the worker processing the item,
+         *                      in the range of [0, thread_pool::size()).
+         */
+        virtual void run(int index, int worker) = 0;
+    };
+
+protected:
+    std::vector<std::thread>    m_threads;
+    std::mutex                  m_run;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_start;
+    std::condition_variable     m_done;
+
+    job*                        m_job;
+    int                         m_num;
+    std::atomic<int>            m_next;
+    int                         m_running;
+    unsigned                    m_generation;
+    bool                        m_quit;
+
+public:
+    /**
+     * Constructs a pool.
+     *  @param  num_threads The number of workers including the thread that
+     *                      calls run(); a value smaller than two creates
+     *                      no thread.
+     */
+    thread_pool(int num_threads)
+        : m_job(NULL), m_num(0), m_next(0), m_running(0),
+        m_generation(0), m_quit(false)
+    {
+        for (int w = 1;w < num_threads;++w) {
+            m_threads.push_back(std::thread(&thread_pool::worker, this, w));
+        }
+    }
+
+    /**
+     * Destructs a pool.
+     */
+    virtual ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_start.notify_all();
+        for (size_t i = 0;i < m_threads.size();++i) {
+            m_threads[i].join();
+        }
+    }
+
+    /**
+     * Returns the number of workers.
+     *  @return int         The number of workers including the calling
+     *                      thread.
+     */
+    int size() const
+    {
+        return (int)m_threads.size() + 1;
+    }
+
+    /**
+     * Executes a job for items 0, ..., n-1 and waits for its completion.
+     *  The calling thread works as the worker #0. The pool executes one job
+     *  at a time; concurrent calls from different threads are serialized,
+     *  and each waits until the job of the previous call completes. This
+     *  function must not be called by a job running on the same pool.
+     *  @param  j           The job.
+     *  @param  n           The number of items.
+     */
+    void run(job& j, int n)
+    {
+        if (m_threads.empty()) {
+            for (int i = 0;i < n;++i) {
+                j.run(i, 0);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> run_lock(m_run);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &j;
+            m_num = n;
+            m_next = 0;
+            m_running = (int)m_threads.size();
+            ++m_generation;
+        }
+        m_start.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_running != 0) {
+            m_done.wait(lock);
+        }
+        m_job = NULL;
+    }
+
+protected:
+    void worker(int w)
+    {
+        unsigned generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_quit && m_generation == generation) {
+                    m_start.wait(lock);
+                }
+                if (m_quit) {
+                    return;
+                }
+                generation = m_generation;
+            }
+
+            work(w);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_running == 0) {
+                    m_done.notify_all();
+                }
+            }
+        }
+    }
+
+    void work(int w)
+    {
+        for (;;) {
+            int i = m_next++;
+            if (m_num <= i) {
+                break;
+            }
+            m_job->run(i, w);
+        }
+    }
+
+private:
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+};
+
+};
+
+#endif/*__SIMSTRING_THREAD_POOL_H__*/